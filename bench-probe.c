@@ -0,0 +1,272 @@
+/*
+# bench-probe: measures the probes of a configuration against a corpus of
+# captured first packets
+#
+# Copyright (C) 2007-2012  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+
+*/
+
+/* bench-probe takes the same options and configuration file as sslh, followed
+ * by corpus directories:
+ *
+ * bench-probe -F sslh.cfg corpus/
+ *
+ * Each sample is a file holding what a client sent first, in a subdirectory
+ * named after the protocol it should go to (corpus/ssh/openssh-9.bin,
+ * corpus/tls/firefox.bin...). Samples in subdirectories that aren't named
+ * after a configured protocol (e.g. corpus/junk/), or named after several of
+ * them (e.g. tls entries with different sni-hostnames), are probed, but can't
+ * be misrouted. */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "probe.h"
+
+const char* server_type = "bench-probe";
+
+/* How long each measurement runs for, at least */
+#define BENCH_NS    200000000LL
+
+struct sample {
+    char *path;
+    const char *expected;   /* name of the subdirectory */
+    struct proto *expected_prot;    /* protocol of that name, NULL if none */
+    char *data;             /* followed by a NUL byte, as probes expect */
+    int len;
+    struct proto *routed;   /* where probe_buffer() sends it */
+    int matched;            /* a probe matched it (not the default protocol) */
+};
+
+static struct sample *samples;
+static int num_samples;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Reads up to MAX_PROBE_SIZE bytes of a sample file; returns 0 if it can't */
+static int load_sample(const char *path, const char *expected,
+                       struct proto *expected_prot)
+{
+    struct sample *s;
+    int fd, n;
+
+    samples = realloc(samples, (num_samples + 1) * sizeof(*samples));
+    if (!samples) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    s = &samples[num_samples];
+    memset(s, 0, sizeof(*s));
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return 0;
+    }
+    s->data = malloc(MAX_PROBE_SIZE + 1);
+    if (!s->data) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (n = 0; s->len < MAX_PROBE_SIZE; s->len += n) {
+        n = read(fd, s->data + s->len, MAX_PROBE_SIZE - s->len);
+        if (n <= 0) break;
+    }
+    close(fd);
+    if (n == -1) {
+        perror(path);
+        free(s->data);
+        return 0;
+    }
+    s->data[s->len] = 0;
+    s->path = strdup(path);
+    s->expected = expected;
+    s->expected_prot = expected_prot;
+    num_samples++;
+    return 1;
+}
+
+static int is_dir(const char *path)
+{
+    struct stat st;
+
+    return !stat(path, &st) && S_ISDIR(st.st_mode);
+}
+
+/* Returns the configured protocol called name, NULL if there is none. If
+ * there are several, samples can't tell which one they should go to: warns,
+ * and returns NULL. */
+static struct proto* find_protocol(const char *name)
+{
+    struct proto *p, *found = NULL;
+
+    for (p = get_first_protocol(); p; p = p->next) {
+        if (strcmp(p->description, name))
+            continue;
+        if (found) {
+            fprintf(stderr, "several protocols are named %s: "
+                    "its samples are not checked for misrouting\n", name);
+            return NULL;
+        }
+        found = p;
+    }
+    return found;
+}
+
+/* Loads the samples of each subdirectory of a corpus directory */
+static void load_corpus(const char *corpus)
+{
+    struct dirent **dirs, **files;
+    struct proto *expected_prot;
+    char *dir, *path, *expected;
+    int num_dirs, num_files, i, j;
+
+    num_dirs = scandir(corpus, &dirs, NULL, alphasort);
+    if (num_dirs == -1) {
+        perror(corpus);
+        exit(1);
+    }
+    for (i = 0; i < num_dirs; i++) {
+        asprintf(&dir, "%s/%s", corpus, dirs[i]->d_name);
+        if ((dirs[i]->d_name[0] != '.') && is_dir(dir)) {
+            expected = strdup(dirs[i]->d_name);
+            expected_prot = find_protocol(expected);
+            num_files = scandir(dir, &files, NULL, alphasort);
+            for (j = 0; j < num_files; j++) {
+                asprintf(&path, "%s/%s", dir, files[j]->d_name);
+                if ((files[j]->d_name[0] != '.') && !is_dir(path))
+                    load_sample(path, expected, expected_prot);
+                free(path);
+                free(files[j]);
+            }
+            if (num_files > 0)
+                free(files);
+        }
+        free(dir);
+        free(dirs[i]);
+    }
+    free(dirs);
+}
+
+/* Runs all samples through probe_buffer() (p == NULL) or through the probe of
+ * p, as many times as it takes to last BENCH_NS. Returns the average time per
+ * sample in ns. */
+static double time_probe(struct proto *p)
+{
+    volatile long sink = 0;
+    long long start, elapsed;
+    long rounds = 0;
+    int i;
+
+    start = now_ns();
+    do {
+        for (i = 0; i < num_samples; i++) {
+            if (p)
+                sink += p->probe(samples[i].data, samples[i].len, p);
+            else
+                sink += (long)probe_buffer(samples[i].data, samples[i].len, 1, -1);
+        }
+        rounds++;
+        elapsed = now_ns() - start;
+    } while (elapsed < BENCH_NS);
+
+    return (double)elapsed / rounds / num_samples;
+}
+
+static void print_results(void)
+{
+    struct proto *p;
+    struct sample *s;
+    int i, hits, expected, misrouted, total_misrouted = 0, unmatched = 0;
+
+    printf("%d samples, probe_buffer(): %.0f ns/sample\n\n",
+           num_samples, time_probe(NULL));
+
+    printf("%-16s %10s %8s %7s %9s %10s\n",
+           "protocol", "ns/probe", "hits", "share", "expected", "misrouted");
+    for (p = get_first_protocol(); p; p = p->next) {
+        hits = expected = misrouted = 0;
+        for (i = 0; i < num_samples; i++) {
+            s = &samples[i];
+            if (s->matched && (s->routed == p))
+                hits++;
+            if (s->expected_prot == p) {
+                expected++;
+                if (s->routed != p)
+                    misrouted++;
+            }
+        }
+        printf("%-16s %10.0f %8d %6.1f%% %9d %10d\n", p->description,
+               p->probe ? time_probe(p) : 0.0, hits,
+               num_samples ? 100.0 * hits / num_samples : 0.0,
+               expected, misrouted);
+    }
+
+    for (i = 0; i < num_samples; i++)
+        if (!samples[i].matched)
+            unmatched++;
+    printf("%-16s %10s %8d %6.1f%%\n", "(no match)", "", unmatched,
+           num_samples ? 100.0 * unmatched / num_samples : 0.0);
+
+    for (i = 0; i < num_samples; i++) {
+        s = &samples[i];
+        if (!s->expected_prot || (s->routed == s->expected_prot))
+            continue;
+        if (!total_misrouted++)
+            printf("\nmisrouted:\n");
+        printf("%s: expected %s, went to %s%s\n", s->path, s->expected,
+               s->routed->description, s->matched ? "" : " (no match)");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct sample *s;
+    int i;
+
+    read_config(argc, argv);
+    if (optind == argc) {
+        fprintf(stderr, "usage: %s [sslh options] <corpus directory>...\n", argv[0]);
+        exit(2);
+    }
+    for (i = optind; i < argc; i++)
+        load_corpus(argv[i]);
+    if (!num_samples) {
+        fprintf(stderr, "no samples found\n");
+        exit(1);
+    }
+
+    /* Where each sample goes, as if the client sent it all at once */
+    for (i = 0; i < num_samples; i++) {
+        s = &samples[i];
+        s->routed = probe_buffer(s->data, s->len, 1, -1);
+        s->matched = s->routed->probe &&
+            (s->routed->probe(s->data, s->len, s->routed) == PROBE_MATCH);
+    }
+
+    print_results();
+    return 0;
+}
@@ -6,8 +6,13 @@
 
 #define _GNU_SOURCE
 #include <stdarg.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
 
 #include "common.h"
+#include "slab.h"
 
 /* Added to make the code compilable under CYGWIN 
  * */
@@ -21,11 +26,25 @@
  * parameters
  */
 int verbose = 0;
-int probing_timeout = 2;
+double probing_timeout = 2;
+int num_threads = 1;
+int listen_backlog = SOMAXCONN;
+int accept_batch = 64;
+int relay_budget = 131072;
+int http_header_limit = 4096;
+int low_watermark = 32768;
+int high_watermark = 131072;
 int inetd = 0;
 int foreground = 0;
 int background = 0;
 int numeric = 0;
+int use_splice = 0;
+int defer_accept = 0;
+int prefork = 0;
+int min_spare_workers = 4;
+int max_spare_workers = 16;
+int max_workers = 256;
+int max_worker_connections = 1000;
 const char *user_name, *pid_file, *map_sock_path;
 
 struct addrinfo *addr_listen = NULL; /* what addresses do we listen to? */
@@ -50,17 +69,50 @@ void check_res_dumpdie(int res, struct addrinfo *addr, char* syscall)
     }
 }
 
+/* With --defer-accept, the kernel holds connections back until the client
+ * sends data. TCP_DEFER_ACCEPT takes whole seconds: round the probing
+ * timeout up, so silent clients are never handed over before it is over. */
+static int defer_accept_timeout(void)
+{
+    int secs = probing_timeout;
+
+    if (secs < probing_timeout)
+        secs++;
+    return secs ? secs : 1;
+}
+
+/* Returns 1 if a newly accepted connection comes from a client that hasn't
+ * sent anything although the listening socket defers accepts: the kernel has
+ * already waited for the probing timeout (or longer, as it only checks when
+ * it retransmits the SYN-ACK), so the connection has timed out. */
+int silent_client(int fd)
+{
+    char c;
+    int res;
+
+    if (!defer_accept)
+        return 0;
+
+    res = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return (res == -1) && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
 /* Starts listening sockets on specified addresses.
  * IN: addr[], num_addr
+ *     num_sets: number of sockets to open on each address. If more than one,
+ *     sockets are opened with SO_REUSEPORT so the kernel spreads incoming
+ *     connections among them (e.g. one set for each worker thread).
  * OUT: *sockfd[]  pointer to newly-allocated array of file descriptors
- * Returns number of addresses bound
- * Bound file descriptors are returned in newly-allocated *sockfd pointer
+ * Returns number of sockets bound (num_addr * num_sets)
+ * Bound file descriptors are returned in newly-allocated *sockfd pointer:
+ * the sockets of set k are (*sockfd)[k * num_addr] to
+ * (*sockfd)[(k+1) * num_addr - 1], in the order of addr_list.
    */
-int start_listen_sockets(int *sockfd[], struct addrinfo *addr_list)
+int start_listen_sockets(int *sockfd[], struct addrinfo *addr_list, int num_sets)
 {
    struct sockaddr_storage *saddr;
    struct addrinfo *addr;
-   int i, res, reuse;
+   int i, k, fd, res, reuse, defer;
    int num_addr = 0;
 
    for (addr = addr_list; addr; addr = addr->ai_next)
@@ -69,111 +121,546 @@ int start_listen_sockets(int *sockfd[], struct addrinfo *addr_list)
    if (verbose)
        fprintf(stderr, "listening to %d addresses\n", num_addr);
 
-   *sockfd = malloc(num_addr * sizeof(*sockfd[0]));
+   *sockfd = malloc(num_addr * num_sets * sizeof(*sockfd[0]));
 
-   for (i = 0, addr = addr_list; i < num_addr && addr; i++, addr = addr->ai_next) {
-       if (!addr) {
-           fprintf(stderr, "FATAL: Inconsistent listen number. This should not happen.\n");
-           exit(1);
-       }
-       saddr = (struct sockaddr_storage*)addr->ai_addr;
+   for (k = 0; k < num_sets; k++) {
+       for (i = 0, addr = addr_list; i < num_addr && addr; i++, addr = addr->ai_next) {
+           if (!addr) {
+               fprintf(stderr, "FATAL: Inconsistent listen number. This should not happen.\n");
+               exit(1);
+           }
+           saddr = (struct sockaddr_storage*)addr->ai_addr;
+
+           fd = socket(saddr->ss_family, SOCK_STREAM, 0);
+           check_res_dumpdie(fd, addr, "socket");
 
-       (*sockfd)[i] = socket(saddr->ss_family, SOCK_STREAM, 0);
-       check_res_dumpdie((*sockfd)[i], addr, "socket");
+           reuse = 1;
+           res = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char*)&reuse, sizeof(reuse));
+           check_res_dumpdie(res, addr, "setsockopt");
 
-       reuse = 1;
-       res = setsockopt((*sockfd)[i], SOL_SOCKET, SO_REUSEADDR, (char*)&reuse, sizeof(reuse));
-       check_res_dumpdie(res, addr, "setsockopt");
+           if (num_sets > 1) {
+               res = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char*)&reuse, sizeof(reuse));
+               check_res_dumpdie(res, addr, "setsockopt(SO_REUSEPORT)");
+           }
 
-       res = bind((*sockfd)[i], addr->ai_addr, addr->ai_addrlen);
-       check_res_dumpdie(res, addr, "bind");
+           if (defer_accept && (saddr->ss_family != AF_UNIX)) {
+               defer = defer_accept_timeout();
+               res = setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer));
+               check_res_dumpdie(res, addr, "setsockopt(TCP_DEFER_ACCEPT)");
+           }
 
-       res = listen ((*sockfd)[i], 50);
-       check_res_dumpdie(res, addr, "listen");
+           res = bind(fd, addr->ai_addr, addr->ai_addrlen);
+           check_res_dumpdie(res, addr, "bind");
 
+           res = listen (fd, listen_backlog);
+           check_res_dumpdie(res, addr, "listen");
+
+           (*sockfd)[k * num_addr + i] = fd;
+       }
    }
 
-   return num_addr;
+   return num_addr * num_sets;
 }
 
-/* Connect to first address that works and returns a file descriptor, or -1 if
- * none work. cnx_name points to the name of the service (for logging) */
-int connect_addr(struct addrinfo *addr, const char* cnx_name)
+/* With several workers, each worker runs its own event loop on its own set of
+ * listening sockets (opened with SO_REUSEPORT), so nothing on the relaying
+ * path is shared between threads. */
+struct worker {
+    pthread_t thread;
+    int *listen_sockets;
+    int num_listen;
+    worker_loop_t *loop;
+};
+
+static void* start_worker(void* arg)
+{
+    struct worker *w = arg;
+
+    w->loop(w->listen_sockets, w->num_listen);
+    return NULL;
+}
+
+/* Runs loop() once for each of the num_threads sets of sockets in
+ * listen_sockets (as returned by start_listen_sockets()), each in its own
+ * thread. The first worker runs in the calling thread, so this only returns
+ * if that loop returns. */
+void run_workers(int listen_sockets[], int num_listen, worker_loop_t *loop)
+{
+    struct worker *workers;
+    int i, res, per_worker;
+
+    per_worker = num_listen / num_threads;
+    workers = calloc(num_threads, sizeof(*workers));
+    for (i = 0; i < num_threads; i++) {
+        workers[i].listen_sockets = &listen_sockets[i * per_worker];
+        workers[i].num_listen = per_worker;
+        workers[i].loop = loop;
+    }
+
+    for (i = 1; i < num_threads; i++) {
+        res = pthread_create(&workers[i].thread, NULL, start_worker, &workers[i]);
+        if (res) {
+            log_message(LOG_ERR, "pthread_create: %s\n", strerror(res));
+            exit(1);
+        }
+    }
+
+    if (verbose)
+        fprintf(stderr, "started %d workers\n", num_threads);
+
+    start_worker(&workers[0]);
+}
+
+/* Returns the time in milliseconds from an arbitrary starting point, without
+ * being affected by changes to the system clock */
+long long monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Starts a non-blocking connection to address a and returns the new file
+ * descriptor, or -1 if it failed straight away (the error is logged) */
+static int start_connect(struct addrinfo *a, const char* cnx_name)
 {
-    struct addrinfo *a;
     char buf[NI_MAXHOST];
     int fd, res;
 
-    for (a = addr; a; a = a->ai_next) {
-        if (verbose) 
-            fprintf(stderr, "connecting to %s family %d len %d\n", 
-                    sprintaddr(buf, sizeof(buf), a),
-                    a->ai_addr->sa_family, a->ai_addrlen);
-        fd = socket(a->ai_family, SOCK_STREAM, 0);
-        if (fd == -1) {
-            log_message(LOG_ERR, "forward to %s failed:socket: %s\n", cnx_name, strerror(errno));
-        } else {
-            res = connect(fd, a->ai_addr, a->ai_addrlen);
-            if (res == -1) {
-                log_message(LOG_ERR, "forward to %s failed:connect: %s\n", 
-                            cnx_name, strerror(errno));
-            } else {
-                return fd;
-            }
+    if (verbose) 
+        fprintf(stderr, "connecting to %s family %d len %d\n", 
+                sprintaddr(buf, sizeof(buf), a),
+                a->ai_addr->sa_family, a->ai_addrlen);
+    fd = socket(a->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        log_message(LOG_ERR, "forward to %s failed:socket: %s\n", cnx_name, strerror(errno));
+        return -1;
+    }
+    res = connect(fd, a->ai_addr, a->ai_addrlen);
+    if ((res == -1) && (errno != EINPROGRESS)) {
+        log_message(LOG_ERR, "forward to %s failed:connect: %s\n", 
+                    cnx_name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Prepares connection attempts to the list of addresses addr. Nothing is
+ * started until connect_next() is called. */
+void connect_init(struct connect_attempts *ca, struct addrinfo *addr, 
+                  const char* cnx_name)
+{
+    memset(ca, 0, sizeof(*ca));
+    ca->cnx_name = cnx_name;
+    ca->next_addr = addr;
+    ca->start = monotonic_ms();
+}
+
+/* Starts the next connection attempt if it is due: nothing is in progress, or
+ * the previous attempt started CONNECT_ATTEMPT_DELAY ago, or an attempt
+ * failed. Addresses that fail straight away are skipped.
+ * Returns the file descriptor of the new attempt (it becomes writable when
+ * the attempt finishes), or -1 if no attempt was started. */
+int connect_next(struct connect_attempts *ca)
+{
+    struct addrinfo *a;
+    int fd;
+
+    if (ca->num && 
+        ((ca->num == MAX_CONNECT_ATTEMPTS) || (monotonic_ms() < ca->next_attempt)))
+        return -1;
+
+    while ((a = ca->next_addr)) {
+        ca->next_addr = a->ai_next;
+        fd = start_connect(a, ca->cnx_name);
+        if (fd != -1) {
+            ca->fd[ca->num] = fd;
+            ca->addr[ca->num] = a;
+            ca->num++;
+            ca->num_started++;
+            ca->next_attempt = monotonic_ms() + CONNECT_ATTEMPT_DELAY;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+/* Removes attempt i from the attempts in progress (without closing it) */
+static void remove_attempt(struct connect_attempts *ca, int i)
+{
+    ca->num--;
+    ca->fd[i] = ca->fd[ca->num];
+    ca->addr[i] = ca->addr[ca->num];
+}
+
+/* Waits up to timeout milliseconds (-1: no limit) for attempts in progress
+ * to finish. Attempts that failed are closed, and the next attempt becomes
+ * due straight away.
+ * Returns the file descriptor of the first attempt that succeeded (the other
+ * attempts are closed), or -1 if none has succeeded yet. */
+int connect_poll(struct connect_attempts *ca, int timeout)
+{
+    struct pollfd pfd[MAX_CONNECT_ATTEMPTS];
+    char buf[NI_MAXHOST];
+    struct addrinfo *a;
+    int i, res, err, fd;
+    socklen_t len;
+
+    for (i = 0; i < ca->num; i++) {
+        pfd[i].fd = ca->fd[i];
+        pfd[i].events = POLLOUT;
+        pfd[i].revents = 0;
+    }
+    res = poll(pfd, ca->num, timeout);
+    if (res <= 0) {
+        if ((res == -1) && (errno != EINTR))
+            log_message(LOG_ERR, "poll: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Going backwards, removing an attempt only moves one that has been
+     * looked at already */
+    for (i = ca->num - 1; i >= 0; i--) {
+        if (!pfd[i].revents)
+            continue;
+
+        len = sizeof(err);
+        if (getsockopt(ca->fd[i], SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+            err = errno;
+        if (err) {
+            log_message(LOG_ERR, "forward to %s failed:connect: %s\n", 
+                        ca->cnx_name, strerror(err));
+            close(ca->fd[i]);
+            remove_attempt(ca, i);
+            ca->next_attempt = 0;
+            continue;
         }
+
+        fd = ca->fd[i];
+        a = ca->addr[i];
+        remove_attempt(ca, i);
+        connect_abort(ca);
+
+        if (ca->num_started > 1)
+            log_message(LOG_INFO, "forward to %s: %s won after %lld ms (%d attempts)\n",
+                        ca->cnx_name, sprintaddr(buf, sizeof(buf), a),
+                        monotonic_ms() - ca->start, ca->num_started);
+        else if (verbose)
+            fprintf(stderr, "connected to %s in %lld ms\n", 
+                    sprintaddr(buf, sizeof(buf), a), monotonic_ms() - ca->start);
+        return fd;
     }
     return -1;
 }
 
-/* Store some data to write to the queue later */
+/* Returns how long (in milliseconds) until the next attempt is due, or -1 if
+ * none will be started unless one of those in progress fails */
+int connect_wait(struct connect_attempts *ca)
+{
+    long long wait;
+
+    if (!ca->next_addr || (ca->num == MAX_CONNECT_ATTEMPTS))
+        return -1;
+    if (!ca->num)
+        return 0;
+
+    wait = ca->next_attempt - monotonic_ms();
+    return wait > 0 ? wait : 0;
+}
+
+/* Closes all the attempts in progress */
+void connect_abort(struct connect_attempts *ca)
+{
+    int i;
+
+    for (i = 0; i < ca->num; i++)
+        close(ca->fd[i]);
+    ca->num = 0;
+}
+
+/* Make the file descriptor non-block  */
+int set_nonblock(int fd)
+{
+    int flags;
+
+    flags = fcntl(fd, F_GETFL);
+    CHECK_RES_RETURN(flags, "fcntl");
+
+    flags |= O_NONBLOCK;
+
+    flags = fcntl(fd, F_SETFL, flags);
+    CHECK_RES_RETURN(flags, "fcntl");
+
+    return flags;
+}
+
+/* Connects to the addresses (see connect_next()) and returns a blocking file
+ * descriptor for the first connection that works, or -1 if none work.
+ * cnx_name points to the name of the service (for logging) */
+int connect_addr(struct addrinfo *addr, const char* cnx_name)
+{
+    struct connect_attempts ca;
+    int fd, flags;
+
+    connect_init(&ca, addr, cnx_name);
+    do {
+        connect_next(&ca);
+        if (connect_failed(&ca))
+            return -1;
+        fd = connect_poll(&ca, connect_wait(&ca));
+    } while (fd == -1);
+
+    flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    return fd;
+}
+
+/* Pipes for splice(2) relaying that are not in use. A connection only holds
+ * a pipe while data is stuck in it (its target can't take more), so a
+ * handful of them go a long way. */
+#define PIPE_POOL_SIZE  16
+
+/* Most data moved by one call to splice(2): the default capacity of a pipe */
+#define SPLICE_SIZE     65536
+
+static __thread int pipe_pool[PIPE_POOL_SIZE][2];
+static __thread int pipe_pool_num;
+
+/* How much a pipe holds (F_GETPIPE_SZ) */
+static __thread int pipe_capacity = SPLICE_SIZE;
+
+/* Gives the queue a pipe, from the pool or a new one. Returns -1 on failure */
+static int get_pipe(struct queue *q)
+{
+    int n;
+
+    if (pipe_pool_num) {
+        pipe_pool_num--;
+        q->pipe[0] = pipe_pool[pipe_pool_num][0];
+        q->pipe[1] = pipe_pool[pipe_pool_num][1];
+        return 0;
+    }
+
+    if (pipe2(q->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        log_message(LOG_ERR, "pipe2: %s\n", strerror(errno));
+        q->pipe[0] = q->pipe[1] = -1;
+        return -1;
+    }
+    n = fcntl(q->pipe[0], F_GETPIPE_SZ);
+    if (n > 0)
+        pipe_capacity = n;
+    return 0;
+}
+
+/* Takes the pipe back from the queue: it goes back to the pool if it is empty
+ * and the pool has room, otherwise it is closed */
+static void release_pipe(struct queue *q)
+{
+    if (q->pipe[0] == -1)
+        return;
+
+    if (!q->pipe_data && (pipe_pool_num < PIPE_POOL_SIZE)) {
+        pipe_pool[pipe_pool_num][0] = q->pipe[0];
+        pipe_pool[pipe_pool_num][1] = q->pipe[1];
+        pipe_pool_num++;
+    } else {
+        close(q->pipe[0]);
+        close(q->pipe[1]);
+    }
+    q->pipe[0] = q->pipe[1] = -1;
+    q->pipe_data = 0;
+}
+
+/* Writes the data held in the pipe of the queue to its file descriptor.
+ * Returns the number of bytes written, or -1 (errno set) */
+static int flush_pipe(struct queue *q)
+{
+    int n;
+
+    /* No SPLICE_F_NONBLOCK: whether this blocks depends on the socket, as for
+     * write() (the pipe has data, so reading it never blocks) */
+    n = splice(q->pipe[0], NULL, q->fd, NULL, q->pipe_data, SPLICE_F_MOVE);
+    if (n == -1)
+        return -1;
+
+    q->pipe_data -= n;
+    if (!q->pipe_data)
+        release_pipe(q);
+    return n;
+}
+
+/* Defered data is kept in a list of chunks taken from a pool: appending
+ * fills the last chunk, or adds a new one when it is full, and chunks go back
+ * to the pool as soon as they are written out. How much a queue may hold is
+ * up to the caller (see queue_full()). */
+#define DEFER_CHUNK_SIZE    (4 * BUFSIZ)
+
+struct defer_chunk {
+    struct defer_chunk *next;
+    int begin, end;     /* data waiting is data[begin] to data[end-1] */
+    char data[];
+};
+
+#define CHUNK_DATA_SIZE     ((int)(DEFER_CHUNK_SIZE - sizeof(struct defer_chunk)))
+
+/* Most chunks written by one call to flush_defered() */
+#define MAX_FLUSH_CHUNKS    16
+
+/* Chunks not in use, shared by the connections of a thread */
+static __thread struct slab_pool defer_pool;
+static __thread int defer_pool_ready;
+
+/* Store some data to write to the queue later, after what is already there.
+ * Returns 0, or -1 if out of memory (the error is logged) */
 int defer_write(struct queue *q, void* data, int data_size) 
 {
+    struct defer_chunk *c;
+    int n;
+
     if (verbose) 
         fprintf(stderr, "**** writing defered on fd %d\n", q->fd);
-    q->defered_data = malloc(data_size);
-    q->begin_defered_data = q->defered_data;
-    q->defered_data_size = data_size;
-    memcpy(q->defered_data, data, data_size);
+
+    if (!defer_pool_ready) {
+        slab_pool_init(&defer_pool, DEFER_CHUNK_SIZE);
+        defer_pool_ready = 1;
+    }
+
+    while (data_size) {
+        c = q->defered_tail;
+        if (!c || (c->end == CHUNK_DATA_SIZE)) {
+            c = slab_alloc(&defer_pool);
+            if (!c) {
+                log_message(LOG_ERR, "out of memory for defered data on fd %d\n", q->fd);
+                return -1;
+            }
+            c->next = NULL;
+            c->begin = c->end = 0;
+            if (q->defered_tail)
+                q->defered_tail->next = c;
+            else
+                q->defered_head = c;
+            q->defered_tail = c;
+        }
+
+        n = CHUNK_DATA_SIZE - c->end;
+        if (n > data_size)
+            n = data_size;
+        memcpy(c->data + c->end, data, n);
+        c->end += n;
+        data = (char*)data + n;
+        data_size -= n;
+        q->defered_data_size += n;
+    }
 
     return 0;
 }
 
+/* Gives the first chunk of defered data of the queue back to the pool */
+static void release_chunk(struct queue *q)
+{
+    struct defer_chunk *c = q->defered_head;
+
+    q->defered_head = c->next;
+    if (!q->defered_head)
+        q->defered_tail = NULL;
+    slab_free(&defer_pool, c);
+}
+
+/* Drops the defered data of the queue */
+static void release_defered(struct queue *q)
+{
+    while (q->defered_head)
+        release_chunk(q);
+    q->defered_data_size = 0;
+}
+
+/* Returns the memory of defered data chunks that are no longer used to the
+ * system (see slab_trim()) */
+void trim_buffers(void)
+{
+    if (defer_pool_ready)
+        slab_trim(&defer_pool);
+}
+
 /* tries to flush some of the data for specified queue
  * Upon success, the number of bytes written is returned.
  * Upon failure, -1 returned (e.g. connexion closed)
  * */
 int flush_defered(struct queue *q)
 {
-    int n;
+    struct iovec iov[MAX_FLUSH_CHUNKS];
+    struct defer_chunk *c;
+    int i, n, left;
 
     if (verbose)
         fprintf(stderr, "flushing defered data to fd %d\n", q->fd);
 
-    n = write(q->fd, q->defered_data, q->defered_data_size);
+    if (q->pipe_data)
+        return flush_pipe(q);
+
+    if (!q->defered_data_size)
+        return 0;
+
+    for (i = 0, c = q->defered_head; c && (i < MAX_FLUSH_CHUNKS); i++, c = c->next) {
+        iov[i].iov_base = c->data + c->begin;
+        iov[i].iov_len = c->end - c->begin;
+    }
+
+    n = writev(q->fd, iov, i);
     if (n == -1)
         return n;
 
-    if (n == q->defered_data_size) {
-        /* All has been written -- release the memory */
-        free(q->begin_defered_data);
-        q->begin_defered_data = NULL;
-        q->defered_data = NULL;
-        q->defered_data_size = 0;
-    } else {
-        /* There is data left */
-        q->defered_data += n;
-        q->defered_data_size -= n;
+    q->defered_data_size -= n;
+    for (left = n; left; ) {
+        c = q->defered_head;
+        if (left < c->end - c->begin) {
+            c->begin += left;
+            break;
+        }
+        /* This chunk has been written -- release it */
+        left -= c->end - c->begin;
+        release_chunk(q);
     }
 
     return n;
 }
 
+/* Returns the defered data of the queue as one block of *len bytes, followed
+ * by a NUL byte that is not part of the data (what probes expect). Returns
+ * NULL if there is no data, or if it doesn't fit in one chunk (probing never
+ * reads that much); *len is set in any case. */
+const char* defered_block(struct queue *q, int *len)
+{
+    struct defer_chunk *c = q->defered_head;
+
+    *len = q->defered_data_size;
+    if (!c || (c != q->defered_tail) || (c->end == CHUNK_DATA_SIZE))
+        return NULL;
+
+    c->data[c->end] = 0;
+    return c->data + c->begin;
+}
+
+/* Is there high bytes or more waiting in the queue, or as much as its pipe
+ * can hold? */
+int queue_full(struct queue *q, int high)
+{
+    if (q->pipe_data)
+        return q->pipe_data >= (pipe_capacity < high ? pipe_capacity : high);
+    return q->defered_data_size >= high;
+}
+
 
 void init_cnx(struct connection *cnx)
 {
     memset(cnx, 0, sizeof(*cnx));
+    cnx->listener = -1;
     cnx->q[0].fd = -1;
     cnx->q[1].fd = -1;
+    cnx->q[0].pipe[0] = cnx->q[0].pipe[1] = -1;
+    cnx->q[1].pipe[0] = cnx->q[1].pipe[1] = -1;
 }
 
 void dump_connection(struct connection *cnx)
@@ -184,20 +671,103 @@ void dump_connection(struct connection *cnx)
 }
 
 
+/* Releases whatever data the queue still holds, and its buffers */
+void release_queue(struct queue *q)
+{
+    release_defered(q);
+    release_pipe(q);
+}
+
+/* Same as fd2fd(), but data goes through a pipe with splice(2) so it is
+ * never copied to user space. Data that could not be written stays in the
+ * pipe (see queue_pending()) */
+static int fd2fd_splice(struct queue *target_q, struct queue *from_q)
+{
+    int size_r, size_w, room;
+
+    if ((target_q->pipe[0] == -1) && (get_pipe(target_q) == -1))
+        return -1;
+
+    /* Data may already be waiting in the pipe: new data goes after it */
+    room = pipe_capacity - target_q->pipe_data;
+    if (room <= 0)
+        return FD_STALLED;
+    if (room > SPLICE_SIZE)
+        room = SPLICE_SIZE;
+
+    size_r = splice(from_q->fd, NULL, target_q->pipe[1], NULL, room, 
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (size_r == -1) {
+        if (!target_q->pipe_data)
+            release_pipe(target_q);
+        switch (errno) {
+        case EAGAIN:
+            if (verbose)
+                fprintf(stderr, "reading 0 from %d\n", from_q->fd);
+            return FD_NODATA;
+
+        case ECONNRESET:
+        case EPIPE:
+            return FD_CNXCLOSED;
+        }
+    }
+
+    CHECK_RES_RETURN(size_r, "splice");
+
+    if (size_r == 0) {
+        /* End of file: the connection only counts as closed once what is
+         * still in the pipe has been written (see fd2fd()) */
+        from_q->eof = 1;
+        if (target_q->pipe_data && (flush_pipe(target_q) == -1) && (errno != EAGAIN))
+            return -1;
+        if (target_q->pipe_data)
+            return FD_STALLED;
+        release_pipe(target_q);
+        return FD_CNXCLOSED;
+    }
+
+    target_q->pipe_data += size_r;
+    size_w = flush_pipe(target_q);
+    if (size_w == -1) {
+        switch (errno) {
+        case EAGAIN:
+            return FD_STALLED;
+
+        case ECONNRESET:
+        case EPIPE:
+            return FD_CNXCLOSED;
+        }
+    } else if (target_q->pipe_data) {
+        return FD_STALLED;
+    }
+
+    CHECK_RES_RETURN(size_w, "splice");
+
+    return size_w;
+}
+
 /* 
  * moves data from one fd to other
  *
  * retuns number of bytes copied if success
- * returns 0 (FD_CNXCLOSED) if incoming socket closed
+ * returns 0 (FD_CNXCLOSED) if incoming socket closed, and all it sent has
+ * been written
  * returns FD_NODATA if no data was available
- * returns FD_STALLED if data was read, could not be written, and has been
- * stored in temporary buffer.
+ * returns FD_STALLED if data was read, could not be written (or had to wait
+ * behind data already defered), and has been stored in temporary buffer; or
+ * if the incoming socket closed (from_q->eof is set) but data still waits to
+ * be written.
  */
 int fd2fd(struct queue *target_q, struct queue *from_q)
 {
    char buffer[BUFSIZ];
    int target, from, size_r, size_w;
 
+   /* Data that was defered before relaying started (e.g. when probing) has
+    * to go out before anything is spliced */
+   if (use_splice && !target_q->defered_data_size)
+       return fd2fd_splice(target_q, from_q);
+
    target = target_q->fd;
    from = from_q->fd;
 
@@ -217,8 +787,17 @@ int fd2fd(struct queue *target_q, struct queue *from_q)
 
    CHECK_RES_RETURN(size_r, "read");
 
-   if (size_r == 0)
-      return FD_CNXCLOSED;
+   if (size_r == 0) {
+      from_q->eof = 1;
+      return queue_pending(target_q) ? FD_STALLED : FD_CNXCLOSED;
+   }
+
+   if (queue_pending(target_q)) {
+       /* Data is already waiting to be written: this goes after it */
+       if (defer_write(target_q, buffer, size_r) == -1)
+           return -1;
+       return FD_STALLED;
+   }
 
    size_w = write(target, buffer, size_r);
    /* process -1 when we know how to deal with it */
@@ -226,7 +805,8 @@ int fd2fd(struct queue *target_q, struct queue *from_q)
        switch (errno) {
        case EAGAIN:
            /* write blocked: Defer data */
-           defer_write(target_q, buffer, size_r);
+           if (defer_write(target_q, buffer, size_r) == -1)
+               return -1;
            return FD_STALLED;
 
        case ECONNRESET:
@@ -236,7 +816,8 @@ int fd2fd(struct queue *target_q, struct queue *from_q)
        }
    } else if (size_w < size_r) {
        /* incomplete write -- defer the rest of the data */
-       defer_write(target_q, buffer + size_w, size_r - size_w);
+       if (defer_write(target_q, buffer + size_w, size_r - size_w) == -1)
+           return -1;
        return FD_STALLED;
    }
 
@@ -276,7 +857,49 @@ char* sprintaddr(char* buf, size_t size, struct addrinfo *a)
    return buf;
 }
 
-/* Turns a hostname and port (or service) into a list of struct addrinfo 
+/* Reorders a list of addresses so address families alternate, starting with
+ * the family of the first address (RFC 8305, section 4): if one family is
+ * broken, the second connection attempt already uses the other one. */
+static void interleave_families(struct addrinfo **list)
+{
+   struct addrinfo *first = NULL, *other = NULL, **f = &first, **o = &other;
+   struct addrinfo *a, *next, **tail;
+   int family;
+
+   if (!*list)
+      return;
+
+   family = (*list)->ai_family;
+   for (a = *list; a; a = next) {
+      next = a->ai_next;
+      a->ai_next = NULL;
+      if (a->ai_family == family) {
+         *f = a;
+         f = &a->ai_next;
+      } else {
+         *o = a;
+         o = &a->ai_next;
+      }
+   }
+
+   tail = list;
+   while (first || other) {
+      if (first) {
+         *tail = first;
+         tail = &first->ai_next;
+         first = first->ai_next;
+      }
+      if (other) {
+         *tail = other;
+         tail = &other->ai_next;
+         other = other->ai_next;
+      }
+   }
+   *tail = NULL;
+}
+
+/* Turns a hostname and port (or service) into a list of struct addrinfo, with
+ * address families interleaved
  * returns 0 on success, -1 otherwise and logs error
  **/
 int resolve_split_name(struct addrinfo **out, const char* host, const char* serv)
@@ -291,6 +914,8 @@ int resolve_split_name(struct addrinfo **out, const char* host, const char* serv
    res = getaddrinfo(host, serv, &hint, out);
    if (res)
       log_message(LOG_ERR, "%s `%s:%s'\n", gai_strerror(res), host, serv);
+   else
+      interleave_families(out);
    return res;
 }
 
@@ -49,7 +49,9 @@
 
 enum connection_state {
     ST_PROBING=1,    /* Waiting for timeout to find where to forward */
-    ST_SHOVELING   /* Connexion is established */
+    ST_CONNECTING,   /* Waiting for the connection to the server */
+    ST_SHOVELING,  /* Connexion is established */
+    ST_POOLED      /* Connected to the server, waiting for a client (sslh-select) */
 };
 
 /* this is used to pass protocols through the command-line parameter parsing */
@@ -57,16 +59,76 @@ enum connection_state {
 
 /* A 'queue' is composed of a file descriptor (which can be read from or
  * written to), and a queue for defered write data */
+struct defer_chunk;
+
 struct queue {
     int fd;
-    void *begin_defered_data;
-    void *defered_data;
-    int defered_data_size;
+
+    /* Data that couldn't be written yet, in chunks taken from a pool (see
+     * defer_write()) */
+    struct defer_chunk *defered_head, *defered_tail;
+    int defered_data_size;  /* number of bytes to write */
+
+    /* Set when the queue reached the high watermark, until it goes down to
+     * the low watermark: the other side is not read from meanwhile */
+    int full;
+
+    /* Set once reading fd returned end of file: what it sent before still
+     * has to be written to the other side before the connection is closed */
+    int eof;
+
+    /* When relaying with splice(2): pipe holding the data read from the
+     * other side that hasn't been written to fd yet. Pipes come from a pool,
+     * and go back to it as soon as they are empty. */
+    int pipe[2];
+    int pipe_data;
+};
+
+/* Does the queue have data waiting to be written? */
+#define queue_pending(q)    ((q)->defered_data_size || (q)->pipe_data)
+
+/* How much data is waiting? */
+#define queue_size(q)       ((q)->defered_data_size + (q)->pipe_data)
+
+/* Connection attempts to the addresses of a server, happy eyeballs style
+ * (RFC 8305): a new attempt starts every CONNECT_ATTEMPT_DELAY milliseconds,
+ * or as soon as one fails, without waiting for the ones in progress. The
+ * first one to succeed wins and the others are dropped. */
+#define CONNECT_ATTEMPT_DELAY   250
+#define MAX_CONNECT_ATTEMPTS    4
+
+struct connect_attempts {
+    const char *cnx_name;       /* protocol name (for logging) */
+    struct addrinfo *next_addr; /* next address to try */
+    int num;                    /* number of attempts in progress */
+    int fd[MAX_CONNECT_ATTEMPTS];
+    struct addrinfo *addr[MAX_CONNECT_ATTEMPTS];
+    int num_started;
+    long long start, next_attempt;  /* see monotonic_ms() */
 };
 
 struct connection {
     enum connection_state state;
-    time_t probe_timeout;
+
+    /* Index of the listening address the client connected to, -1 if none
+     * (see probe_buffer()) */
+    int listener;
+
+    /* Deadline (see monotonic_ms()) of the probing timeout or of the next
+     * connection attempt, and links in the list of connections waiting for
+     * it */
+    long long deadline;
+    struct connection *timer_prev, *timer_next;
+
+    /* Connection to the server, while in ST_CONNECTING */
+    struct connect_attempts connect;
+
+    /* Backend pool the connection belongs to (sslh-select), if it is a
+     * connection to the server made in advance */
+    struct backend_pool *pool;
+
+    /* How much data each queue may buffer (see struct queue) */
+    int low_watermark, high_watermark;
 
     /* q[0]: queue for external connection (client);
      * q[1]: queue for internal connection (httpd or sshd);
@@ -75,13 +137,22 @@ struct connection {
 };
 
 #define FD_CNXCLOSED    0
-#define FD_NODATA       -1
+#define FD_NODATA       -3
 #define FD_STALLED      -2
 
 
 /* common.c */
 void init_cnx(struct connection *cnx);
+void release_queue(struct queue *q);
+void trim_buffers(void);
 int connect_addr(struct addrinfo *addr, const char* cnx_name);
+int set_nonblock(int fd);
+void connect_init(struct connect_attempts *ca, struct addrinfo *addr, const char* cnx_name);
+int connect_next(struct connect_attempts *ca);
+int connect_poll(struct connect_attempts *ca, int timeout);
+int connect_wait(struct connect_attempts *ca);
+void connect_abort(struct connect_attempts *ca);
+#define connect_failed(ca)  (!(ca)->num && !(ca)->next_addr)
 int fd2fd(struct queue *target, struct queue *from);
 char* sprintaddr(char* buf, size_t size, struct addrinfo *a);
 void resolve_name(struct addrinfo **out, char* fullname);
@@ -94,20 +165,36 @@ void drop_privileges(const char* user_name);
 void write_pid_file(const char* pidfile);
 void log_message(int type, char* msg, ...);
 void dump_connection(struct connection *cnx);
+long long monotonic_ms(void);
 int resolve_split_name(struct addrinfo **out, const char* hostname, const char* port);
 
-int start_listen_sockets(int *sockfd[], struct addrinfo *addr_list);
+int start_listen_sockets(int *sockfd[], struct addrinfo *addr_list, int num_sets);
+int silent_client(int fd);
+
+typedef void worker_loop_t(int *listen_sockets, int num_listen);
+void run_workers(int listen_sockets[], int num_listen, worker_loop_t *loop);
 
 int defer_write(struct queue *q, void* data, int data_size);
 int flush_defered(struct queue *q);
-
-extern int probing_timeout, verbose, inetd, foreground, background, numeric;
+const char* defered_block(struct queue *q, int *len);
+int queue_full(struct queue *q, int high);
+
+extern int verbose, inetd, foreground, background, numeric, use_splice, defer_accept;
+extern double probing_timeout;
+extern int num_threads, listen_backlog, accept_batch, relay_budget;
+extern int http_header_limit;
+extern int low_watermark, high_watermark;
+extern int prefork, min_spare_workers, max_spare_workers, max_workers, max_worker_connections;
 extern struct sockaddr_storage addr_ssl, addr_ssh, addr_openvpn;
 extern struct addrinfo *addr_listen;
 extern const char* USAGE_STRING;
 extern const char* user_name, *pid_file, *map_sock_path;
 extern const char* server_type;
 
+/* sslh-conf.c */
+void read_config(int argc, char *argv[]);
+void printsettings(void);
+
 /* sslh-fork.c */
 void start_shoveler(int);
 
@@ -152,7 +152,7 @@ int main(int argc, char *argv[])
 
    parse_cmdline(argc, argv);
 
-   num_addr_listen = start_listen_sockets(&listen_sockets, addr_listen);
+   num_addr_listen = start_listen_sockets(&listen_sockets, addr_listen, 1);
 
    main_loop(listen_sockets, num_addr_listen, NULL);
 
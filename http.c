@@ -0,0 +1,157 @@
+/*
+# http.c: parsing of HTTP/1.x request headers
+#
+# Copyright (C) 2007-2012  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+#include "http.h"
+
+/* See RFC7230 3.1.1, 5.3 and 5.4 */
+#define MAX_METHOD_LEN  16
+
+/* Returns the length of the line starting at p[0] (without its end of line),
+ * and sets *next to the start of the next line; returns -1 if the line isn't
+ * complete */
+static int line_len(const char *p, const char *end, const char **next)
+{
+    const char *eol = memchr(p, '\n', end - p);
+
+    if (!eol)
+        return -1;
+    *next = eol + 1;
+    if ((eol > p) && (eol[-1] == '\r'))
+        eol--;
+    return eol - p;
+}
+
+/* Sets the host of the request to name[0..len[, without port */
+static void set_host(struct http_request *req, const char *name, int len)
+{
+    const char *end = name + len, *colon;
+
+    if ((len > 0) && (name[0] == '[')) {
+        /* IPv6 literal: the port comes after the bracket */
+        colon = memchr(name, ']', len);
+        if (colon)
+            end = colon + 1;
+    } else {
+        colon = memchr(name, ':', len);
+        if (colon)
+            end = colon;
+    }
+    req->host = name;
+    req->host_len = end - name;
+}
+
+/* Parses the request target p[0..len[ */
+static int parse_target(struct http_request *req, const char *p, int len)
+{
+    const char *end = p + len, *path;
+    int scheme = 0;
+
+    /* Absolute form: the host comes with the URI and overrides the Host
+     * header */
+    if ((len > 7) && !strncasecmp(p, "http://", 7))
+        scheme = 7;
+    else if ((len > 8) && !strncasecmp(p, "https://", 8))
+        scheme = 8;
+
+    if (scheme) {
+        p += scheme;
+        path = memchr(p, '/', end - p);
+        if (!path)
+            path = end;
+        set_host(req, p, path - p);
+        p = path;
+    } else if ((len == 1) && (p[0] == '*')) {
+        /* OPTIONS * */
+        return 1;
+    } else if ((len == 0) || (p[0] != '/')) {
+        return 0;
+    }
+
+    req->path = p;
+    req->path_len = end - p;
+    path = memchr(p, '?', end - p);
+    if (path)
+        req->path_len = path - p;
+    return 1;
+}
+
+/* Parses the request line p[0..len[; sets *version if it has a version
+ * (HTTP/0.9 requests don't, nor headers) */
+static int parse_request_line(struct http_request *req, const char *p, int len,
+                              int *version)
+{
+    const char *end = p + len, *target, *sp;
+
+    /* Method: upper-case token */
+    for (sp = p; (sp < end) && (*sp >= 'A') && (*sp <= 'Z'); sp++)
+        ;
+    if ((sp == p) || (sp == end) || (*sp != ' '))
+        return 0;
+
+    /* Target, then version */
+    target = sp + 1;
+    sp = memchr(target, ' ', end - target);
+    *version = (sp != NULL);
+    if (!sp)
+        sp = end;
+    else if ((end - sp - 1 < 8) || strncmp(sp + 1, "HTTP/1.", 7))
+        return 0;
+    return parse_target(req, target, sp - target);
+}
+
+int parse_http_request(const char *p, int len, struct http_request *req)
+{
+    const char *end = p + len, *next, *value;
+    int n, i, version;
+
+    memset(req, 0, sizeof(*req));
+
+    n = line_len(p, end, &next);
+    if (n < 0) {
+        /* Not a full line yet: could it still be a request line? */
+        for (i = 0; (i < len) && (i < MAX_METHOD_LEN); i++) {
+            if (p[i] == ' ')
+                return i ? HTTP_REQ_TRUNCATED : HTTP_REQ_INVALID;
+            if ((p[i] < 'A') || (p[i] > 'Z'))
+                return HTTP_REQ_INVALID;
+        }
+        return i < MAX_METHOD_LEN ? HTTP_REQ_TRUNCATED : HTTP_REQ_INVALID;
+    }
+    if (!parse_request_line(req, p, n, &version))
+        return HTTP_REQ_INVALID;
+    if (!version)
+        return HTTP_REQ_OK;
+
+    /* Headers, until an empty line or the Host header. A host in the request
+     * target wins over the Host header. */
+    for (p = next; (n = line_len(p, end, &next)) > 0; p = next) {
+        if (req->host)
+            break;
+        if ((n > 5) && !strncasecmp(p, "Host:", 5)) {
+            for (value = p + 5; (value < p + n) && ((*value == ' ') || (*value == '\t')); value++)
+                ;
+            for (i = p + n - value; (i > 0) && ((value[i-1] == ' ') || (value[i-1] == '\t')); i--)
+                ;
+            set_host(req, value, i);
+        }
+    }
+    return n < 0 ? HTTP_REQ_TRUNCATED : HTTP_REQ_OK;
+}
@@ -0,0 +1,40 @@
+/* API for http.c */
+
+#ifndef __HTTP_H_
+#define __HTTP_H_
+
+#include "common.h"
+
+/* Results of parse_http_request() */
+enum http_request_result {
+    HTTP_REQ_INVALID = 0,   /* not an HTTP/1.x request */
+    HTTP_REQ_OK,            /* request line and host (or all headers) parsed */
+    HTTP_REQ_TRUNCATED      /* the data stops before the end of the headers */
+};
+
+/* What we want to know from a request. Pointers point into the parsed buffer;
+ * they are NULL if not found (yet). */
+struct http_request {
+    const char *path;       /* path of the request target, without query */
+    int path_len;
+    const char *host;       /* Host header (or host of an absolute URI), without port */
+    int host_len;
+};
+
+/* Routing criteria of a protocol probed with the builtin HTTP probe (kept in
+ * proto->data); each is a NULL-terminated list, or NULL to accept anything */
+struct http_match {
+    const char **hosts;             /* shell wildcards, e.g. "*.example.org" */
+    const char **path_prefixes;     /* e.g. "/git/" */
+};
+
+/* parse_http_request
+ *
+ * Parses the HTTP/1.x request line and headers at the beginning of
+ * p[0..len[ and fills req with the path and host of the request. Reads
+ * nothing outside of p[0..len[ and allocates nothing. If the result is
+ * HTTP_REQ_TRUNCATED, req holds what was found in the complete lines.
+ */
+int parse_http_request(const char *p, int len, struct http_request *req);
+
+#endif
@@ -0,0 +1,57 @@
+/* Interface of probe plugins
+ *
+ * A probe plugin is a shared object that sslh loads for the protocols
+ * configured with probe: "plugin:/path/to/plugin.so". It must export:
+ *
+ * int sslh_probe_init(int abi_version, const char *protocol, void **data);
+ *     Called once for each protocol that uses the plugin, with
+ *     SSLH_PROBE_ABI_VERSION and the name of the protocol. It may set *data
+ *     to whatever the probe needs. Returns how many bytes the probe needs at
+ *     least to decide (sslh waits for them before calling it), or -1 if the
+ *     plugin can't work with that version or that protocol.
+ *
+ * int sslh_probe(const char *p, int len, void *data);
+ *     Called with the data the client sent so far, p[0..len[ (followed by a
+ *     NUL byte), and what sslh_probe_init() set. Returns SSLH_PROBE_MATCH,
+ *     SSLH_PROBE_NO_MATCH, or SSLH_PROBE_NEED_MORE if it can't tell yet. It
+ *     may be called from several threads at once.
+ *
+ * For example, for a protocol whose clients start with "FOO":
+ *
+ * #include <string.h>
+ * #include "probe-plugin.h"
+ *
+ * int sslh_probe_init(int abi_version, const char *protocol, void **data)
+ * {
+ *     return abi_version == SSLH_PROBE_ABI_VERSION ? 3 : -1;
+ * }
+ *
+ * int sslh_probe(const char *p, int len, void *data)
+ * {
+ *     return memcmp(p, "FOO", 3) ? SSLH_PROBE_NO_MATCH : SSLH_PROBE_MATCH;
+ * }
+ *
+ * gcc -shared -fPIC -o libprobe_foo.so foo.c
+ *
+ * This file doesn't depend on the rest of sslh, so it can be copied along
+ * with plugin sources. SSLH_PROBE_ABI_VERSION changes if any of it does.
+ */
+
+#ifndef __PROBE_PLUGIN_H_
+#define __PROBE_PLUGIN_H_
+
+#define SSLH_PROBE_ABI_VERSION  1
+
+/* Results of sslh_probe() */
+#define SSLH_PROBE_NO_MATCH     0
+#define SSLH_PROBE_MATCH        1
+#define SSLH_PROBE_NEED_MORE    2
+
+/* Names and types of the functions a plugin exports */
+#define SSLH_PROBE_INIT_SYMBOL  "sslh_probe_init"
+#define SSLH_PROBE_SYMBOL       "sslh_probe"
+
+typedef int sslh_probe_init_t(int abi_version, const char *protocol, void **data);
+typedef int sslh_probe_t(const char *p, int len, void *data);
+
+#endif
@@ -21,9 +21,15 @@
 
 #define _GNU_SOURCE
 #include <stdio.h>
-#include <regex.h>
+#include <stdarg.h>
 #include <ctype.h>
+#include <fnmatch.h>
+#include <dlfcn.h>
 #include "probe.h"
+#include "tls.h"
+#include "http.h"
+#include "regex-set.h"
+#include "search.h"
 
 
 
@@ -34,6 +40,7 @@ static int is_xmpp_protocol(const char *p, int len, struct proto*);
 static int is_http_protocol(const char *p, int len, struct proto*);
 static int is_tls_protocol(const char *p, int len, struct proto*);
 static int is_true(const char *p, int len, struct proto* proto) { return 1; }
+static void build_dispatch(void);
 
 /* Table of protocols that have a built-in probe
  */
@@ -49,7 +56,53 @@ static struct proto builtins[] = {
     { "anyprot",     NULL,     NULL,   is_true }
 };
 
+/* Range of values the first byte of the data must be in for a builtin probe
+ * to match; probes not listed can match anything. An OpenVPN packet can't be
+ * longer than what we read, so its length (first two bytes) is small. */
+static struct {
+    T_PROBE *probe;
+    unsigned char low, high;
+} first_bytes[] = {
+    { is_ssh_protocol,      'S', 'S' },
+    { is_openvpn_protocol,  0, (MAX_PROBE_SIZE - 2) >> 8 },
+    { is_tinc_protocol,     '0', '0' },
+    { is_http_protocol,     'A', 'Z' },
+    { is_tls_protocol,      0x16, 0x16 },
+};
+
+/* What the data must start with for a builtin probe to match; probes not
+ * listed could match data that starts with anything. */
+static struct {
+    T_PROBE *probe;
+    const char *prefix;
+} prefixes[] = {
+    { is_ssh_protocol,      "SSH-" },
+    { is_tinc_protocol,     "0 " },
+    { is_tls_protocol,      "\x16\x03" },
+};
+
 static struct proto *protocols;
+static int num_probed;  /* protocols that have a probe */
+
+/* For each value of the first byte of the data, the protocols whose probe
+ * may match, in order (NULL-terminated); dispatch[256] has all protocols
+ * that have a probe */
+static struct proto **dispatch[257];
+
+/* exclusives[i * num_probed + j] is set if the protocols of index i and j can
+ * never both match the same data */
+static unsigned char *exclusives;
+
+/* Hit counters of the probes, and the order they are tried in, for the
+ * connections to one listening address handled by one thread */
+struct probe_stats {
+    unsigned long probed;           /* connections whose protocol got decided */
+    unsigned long *hits;            /* connections each protocol matched, by index */
+    struct proto **dispatch[257];   /* copy of dispatch, reordered by hits */
+};
+
+static __thread struct probe_stats **listener_stats;
+static __thread int num_listener_stats;
 static char* on_timeout = "ssh";
 
 struct proto*  get_builtins(void) {
@@ -86,6 +139,7 @@ struct proto* get_first_protocol(void)
 void set_protocol_list(struct proto* prots)
 {
     protocols = prots;
+    build_dispatch();
 }
 
 /* From http://grapsus.net/blog/post/Hexadecimal-dump-in-C */
@@ -121,13 +175,24 @@ void hexdump(const char *mem, unsigned int len)
     }
 }
 
+/* Does the buffer start with prefix? If the buffer is shorter than prefix
+ * but matches so far, it can't tell yet */
+static int probe_prefix(const char *p, int len, const char *prefix, int prefix_len)
+{
+    switch (match_prefix(p, len, prefix, prefix_len)) {
+    case 1:
+        return PROBE_MATCH;
+    case 0:
+        return PROBE_NEED_MORE;
+    default:
+        return PROBE_NO_MATCH;
+    }
+}
+
 /* Is the buffer the beginning of an SSH connection? */
 static int is_ssh_protocol(const char *p, int len, struct proto *proto)
 {
-    if (!strncmp(p, "SSH-", 4)) {
-        return 1;
-    }
-    return 0;
+    return probe_prefix(p, len, "SSH-", 4);
 }
 
 /* Is the buffer the beginning of an OpenVPN connection?
@@ -142,9 +207,30 @@ static int is_ssh_protocol(const char *p, int len, struct proto *proto)
  */
 static int is_openvpn_protocol (const char*p,int len, struct proto *proto)
 {
-    int packet_len = ntohs(*(uint16_t*)p);
+    int packet_len;
+
+    /* The packet must fit in what we read: its length is small */
+    if (len && ((unsigned char)p[0] > ((MAX_PROBE_SIZE - 2) >> 8)))
+        return PROBE_NO_MATCH;
+    if (len < 3)
+        return PROBE_NEED_MORE;
+
+    /* The first packet of a client is a hard reset: opcode (top 5 bits of
+     * p[2]) P_CONTROL_HARD_RESET_CLIENT_V1, _V2 or _V3. Without that, any
+     * data that starts with a small byte (e.g. TLS) would wait for a packet
+     * that never ends. */
+    switch ((unsigned char)p[2] >> 3) {
+    case 1: case 7: case 10:
+        break;
+    default:
+        return PROBE_NO_MATCH;
+    }
 
-    return packet_len == len - 2;
+    /* The packet may come in several segments: wait for the rest of it */
+    packet_len = ntohs(*(uint16_t*)p);
+    if (len - 2 < packet_len)
+        return PROBE_NEED_MORE;
+    return packet_len == len - 2 ? PROBE_MATCH : PROBE_NO_MATCH;
 }
 
 /* Is the buffer the beginning of a tinc connections?
@@ -152,7 +238,7 @@ static int is_openvpn_protocol (const char*p,int len, struct proto *proto)
  * */
 static int is_tinc_protocol( const char *p, int len, struct proto *proto)
 {
-    return !strncmp(p, "0 ", 2);
+    return probe_prefix(p, len, "0 ", 2);
 }
 
 /* Is the buffer the beginning of a jabber (XMPP) connections?
@@ -161,88 +247,466 @@ static int is_tinc_protocol( const char *p, int len, struct proto *proto)
  * */
 static int is_xmpp_protocol( const char *p, int len, struct proto *proto)
 {
-    return strstr(p, "jabber") ? 1 : 0;
+    const char *stream;
+
+    if (find_string(p, len, "jabber", 6))
+        return PROBE_MATCH;
+
+    /* "jabber" may only come at the end of the stream header (or after a
+     * newline): wait until it's all there */
+    if (len && (p[0] == '<')) {
+        stream = find_string(p, len, "stream:stream", 13);
+        if (!stream || !memchr(stream, '>', p + len - stream))
+            return PROBE_NEED_MORE;
+    }
+    return PROBE_NO_MATCH;
 }
 
-static int probe_http_method(const char *p, const char *opt)
+static const struct string http_methods[] = {
+    STRING("OPTIONS "), STRING("GET "), STRING("HEAD "), STRING("POST "),
+    STRING("PUT "), STRING("DELETE "), STRING("TRACE "), STRING("CONNECT "),
+};
+
+/* Does the buffer start with an HTTP method (RFC2616 5.1.1)? */
+static int probe_http_method(const char *p, int len)
 {
-    return !strcmp(p, opt);
+    int i, res, need_more = 0;
+
+    for (i = 0; i < ARRAY_SIZE(http_methods); i++) {
+        /* Skip the memcmp() for methods that start with another letter */
+        if (len && (p[0] != http_methods[i].s[0]))
+            continue;
+        res = probe_prefix(p, len, http_methods[i].s, http_methods[i].len);
+        if (res == PROBE_MATCH)
+            return res;
+        if (res == PROBE_NEED_MORE)
+            need_more = 1;
+    }
+    return need_more ? PROBE_NEED_MORE : PROBE_NO_MATCH;
+}
+
+/* Does the host name name[0..len[ match one of the patterns? */
+static int match_hostname(const char *host, int len, const char **patterns)
+{
+    char name[256];
+
+    /* Host names can't contain NUL bytes, and are at most 255 bytes long
+     * (RFC1035 2.3.4) */
+    if ((len >= sizeof(name)) || memchr(host, 0, len))
+        return 0;
+    memcpy(name, host, len);
+    name[len] = 0;
+
+    for (; *patterns; patterns++)
+        if (!fnmatch(*patterns, name, FNM_CASEFOLD))
+            return 1;
+    return 0;
+}
+
+/* Does the path start with one of the prefixes? */
+static int match_path(const char *path, int len, const char **prefixes)
+{
+    for (; *prefixes; prefixes++)
+        if (match_prefix(path, len, *prefixes, strlen(*prefixes)) == 1)
+            return 1;
+    return 0;
+}
+
+/* Checks the routing criteria of an HTTP protocol against the request in
+ * p[0..len[ */
+static int probe_http_match(const char *p, int len, const struct http_match *match)
+{
+    struct http_request req;
+    int res, missing = 0;
+
+    res = parse_http_request(p, len, &req);
+    if (res == HTTP_REQ_INVALID)
+        return PROBE_NO_MATCH;
+
+    if (match->path_prefixes) {
+        if (!req.path)
+            missing = 1;
+        else if (!match_path(req.path, req.path_len, match->path_prefixes))
+            return PROBE_NO_MATCH;
+    }
+    if (match->hosts) {
+        if (!req.host)
+            missing = 1;
+        else if (!match_hostname(req.host, req.host_len, match->hosts))
+            return PROBE_NO_MATCH;
+    }
+
+    /* Headers may still be to come, up to the limit */
+    if (missing)
+        return (res == HTTP_REQ_TRUNCATED) && (len < http_header_limit) ?
+            PROBE_NEED_MORE : PROBE_NO_MATCH;
+    return PROBE_MATCH;
 }
 
 /* Is the buffer the beginning of an HTTP connection?  */
 static int is_http_protocol(const char *p, int len, struct proto *proto)
 {
+    /* Requests start with a method, in upper case */
+    if (len && ((p[0] < 'A') || (p[0] > 'Z')))
+        return PROBE_NO_MATCH;
+
+    /* Routing on host or path needs the request headers */
+    if (proto->data)
+        return probe_http_match(p, len, proto->data);
+
     /* If it's got HTTP in the request (HTTP/1.1) then it's HTTP */
-    if (strstr(p, "HTTP"))
-        return 1;
+    if (find_string(p, len, "HTTP", 4))
+        return PROBE_MATCH;
 
     /* Otherwise it could be HTTP/1.0 without version: check if it's got an
-     * HTTP method (RFC2616 5.1.1) */
-    probe_http_method(p, "OPTIONS");
-    probe_http_method(p, "GET");
-    probe_http_method(p, "HEAD");
-    probe_http_method(p, "POST");
-    probe_http_method(p, "PUT");
-    probe_http_method(p, "DELETE");
-    probe_http_method(p, "TRACE");
-    probe_http_method(p, "CONNECT");
+     * HTTP method */
+    return probe_http_method(p, len);
+}
+
+/* Does one of the protocols the client offers match one of ours? */
+static int match_alpn(const struct tls_hello *hello, const char **protocols)
+{
+    const char *name, **p;
+    int pos = 0, name_len;
 
+    while ((name = tls_next_alpn(hello, &pos, &name_len)))
+        for (p = protocols; *p; p++)
+            if ((strlen(*p) == name_len) && !memcmp(*p, name, name_len))
+                return 1;
     return 0;
 }
 
+/* Checks the routing criteria of a TLS protocol against the ClientHello in
+ * p[0..len[ */
+static int probe_tls_match(const char *p, int len, const struct tls_match *match)
+{
+    struct tls_hello hello;
+    int res, missing = 0;
+
+    res = parse_tls_hello(p, len, &hello);
+    if (res == TLS_HELLO_INVALID)
+        return PROBE_NO_MATCH;
+
+    if (match->sni_hostnames) {
+        if (!hello.sni)
+            missing = 1;
+        else if (!match_hostname(hello.sni, hello.sni_len, match->sni_hostnames))
+            return PROBE_NO_MATCH;
+    }
+    if (match->alpn_protocols) {
+        if (!hello.alpn)
+            missing = 1;
+        else if (!match_alpn(&hello, match->alpn_protocols))
+            return PROBE_NO_MATCH;
+    }
+
+    /* Missing extensions may still be to come */
+    if (missing)
+        return res == TLS_HELLO_TRUNCATED ? PROBE_NEED_MORE : PROBE_NO_MATCH;
+    return PROBE_MATCH;
+}
+
 static int is_tls_protocol(const char *p, int len, struct proto *proto)
 {
     /* TLS packet starts with a record "Hello" (0x16), followed by version
      * (0x03 0x00-0x03) (RFC6101 A.1)
      * This means we reject SSLv2 and lower, which is actually a good thing (RFC6176)
      */
-    return p[0] == 0x16 && p[1] == 0x03 && ( p[2] >= 0 && p[2] <= 0x03);
+    if ((len && (p[0] != 0x16)) || ((len > 1) && (p[1] != 0x03)))
+        return PROBE_NO_MATCH;
+    if (len < 3)
+        return PROBE_NEED_MORE;
+    if (p[2] < 0 || p[2] > 0x03)
+        return PROBE_NO_MATCH;
+
+    /* Routing on server name or ALPN needs the ClientHello */
+    if (proto->data)
+        return probe_tls_match(p, len, proto->data);
+    return PROBE_MATCH;
 }
 
 static int regex_probe(const char *p, int len, struct proto *proto)
 {
-    regex_t** probe_list = (regex_t**)(proto->data);
-    int i=0;
+    struct regex_scan scan;
 
-    while (probe_list[i]) {
-        if (!regexec(probe_list[i], p, 0, NULL, 0)) {
-            return 1;
-        }
-        i++;
+    scan.scanned = 0;
+    return regex_set_probe(&scan, p, len, proto->data);
+}
+
+/* A probe loaded from a shared object (see probe-plugin.h) */
+struct plugin {
+    sslh_probe_t *probe;
+    int min_len;    /* bytes the probe needs to decide */
+    void *data;     /* set by the plugin's init function */
+};
+
+static int plugin_probe(const char *p, int len, struct proto *proto)
+{
+    struct plugin *plugin = proto->data;
+
+    if (len < plugin->min_len)
+        return PROBE_NEED_MORE;
+
+    switch (plugin->probe(p, len, plugin->data)) {
+    case SSLH_PROBE_MATCH:
+        return PROBE_MATCH;
+    case SSLH_PROBE_NEED_MORE:
+        return PROBE_NEED_MORE;
+    default:
+        return PROBE_NO_MATCH;
     }
-    return 0;
 }
 
-/* 
- * Read the beginning of data coming from the client connection and check if
- * it's a known protocol. Then leave the data on the defered
- * write buffer of the connection and returns a pointer to the protocol
- * structure
- */
-struct proto* probe_client_protocol(struct connection *cnx)
+int load_probe_plugin(struct proto *p, const char *path)
 {
-    char buffer[BUFSIZ];
-    struct proto *p;
-    int n;
+    sslh_probe_init_t *init;
+    struct plugin *plugin;
+    void *handle;
+
+    handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        fprintf(stderr, "%s: %s\n", p->description, dlerror());
+        return -1;
+    }
 
-    n = read(cnx->q[0].fd, buffer, sizeof(buffer));
-    /* It's possible that read() returns an error, e.g. if the client
-     * disconnected between the previous call to select() and now. If that
-     * happens, we just connect to the default protocol so the caller of this
-     * function does not have to deal with a specific  failure condition (the
-     * connection will just fail later normally). */
-    if (n > 0) {
-        defer_write(&cnx->q[1], buffer, n);
+    plugin = calloc(1, sizeof(*plugin));
+    if (!plugin) {
+        log_message(LOG_ERR, "%s: out of memory loading %s\n", p->description, path);
+        dlclose(handle);
+        return -1;
+    }
+    init = (sslh_probe_init_t*)dlsym(handle, SSLH_PROBE_INIT_SYMBOL);
+    plugin->probe = (sslh_probe_t*)dlsym(handle, SSLH_PROBE_SYMBOL);
+    if (!init || !plugin->probe) {
+        fprintf(stderr, "%s: %s does not export %s and %s\n", p->description,
+                path, SSLH_PROBE_INIT_SYMBOL, SSLH_PROBE_SYMBOL);
+        goto fail;
+    }
 
-        for (p = protocols; p; p = p->next) {
-            if (! p->probe) continue;
-            if (verbose) fprintf(stderr, "probing for %s\n", p->description);
-            if (p->probe(buffer, n, p)) {
-                if (verbose) fprintf(stderr, "probe %s successful\n", p->description);
-                return p;
+    plugin->min_len = init(SSLH_PROBE_ABI_VERSION, p->description, &plugin->data);
+    if ((plugin->min_len < 0) || (plugin->min_len > MAX_PROBE_SIZE)) {
+        fprintf(stderr, "%s: %s failed to initialise (ABI version %d)\n",
+                p->description, path, SSLH_PROBE_ABI_VERSION);
+        goto fail;
+    }
+
+    if (verbose)
+        fprintf(stderr, "%s: loaded probe from %s, needs %d bytes\n",
+                p->description, path, plugin->min_len);
+    p->probe = plugin_probe;
+    p->data = plugin;
+    return 0;
+
+fail:
+    free(plugin);
+    dlclose(handle);
+    return -1;
+}
+
+/* Sets the bytes the data of a protocol can start with in set (a bitmap) */
+static void get_first_bytes(struct proto *p, unsigned char *set)
+{
+    int i, c;
+
+    if (p->probe == regex_probe) {
+        if (regex_set_first_bytes(p->data, set))
+            return;
+    } else {
+        for (i = 0; i < ARRAY_SIZE(first_bytes); i++) {
+            if (first_bytes[i].probe == p->probe) {
+                memset(set, 0, 32);
+                for (c = first_bytes[i].low; c <= first_bytes[i].high; c++)
+                    set[c / 8] |= 1 << (c % 8);
+                return;
             }
         }
     }
+    memset(set, 0xFF, 32);
+}
+
+/* Returns the i-th of the strings the data of p must start with one of, and
+ * sets *len to its length; returns NULL past the last one. There are none if
+ * p could match data that starts with anything. */
+static const char* get_prefix(struct proto *p, int i, int *len)
+{
+    int j;
+
+    if (p->probe == regex_probe)
+        return regex_set_prefix(p->data, i, len);
+
+    for (j = 0; !i && (j < ARRAY_SIZE(prefixes)); j++) {
+        if (prefixes[j].probe == p->probe) {
+            *len = strlen(prefixes[j].prefix);
+            return prefixes[j].prefix;
+        }
+    }
+    return NULL;
+}
+
+/* Can p and q never both match the same data? That's the case if whatever p's
+ * data starts with differs from whatever q's data starts with. */
+static int are_exclusive(struct proto *p, struct proto *q)
+{
+    const char *a, *b;
+    int i, j, a_len, b_len;
+
+    if (!get_prefix(p, 0, &a_len) || !get_prefix(q, 0, &b_len))
+        return 0;
+
+    for (i = 0; (a = get_prefix(p, i, &a_len)); i++)
+        for (j = 0; (b = get_prefix(q, j, &b_len)); j++)
+            if (!memcmp(a, b, a_len < b_len ? a_len : b_len))
+                return 0;
+    return 1;
+}
+
+/* Builds the table of protocols to probe for each first byte of the data */
+static void build_dispatch(void)
+{
+    struct proto *p, *q, **lists;
+    unsigned char set[32];
+    int num = 0, count[257] = { 0 }, c;
+
+    for (p = protocols; p; p = p->next)
+        if (p->probe)
+            p->index = num++;
+    num_probed = num;
+
+    lists = calloc(257 * (num + 1), sizeof(*lists));
+    if (!lists) {
+        log_message(LOG_ERR, "out of memory for the probe dispatch table\n");
+        exit(1);
+    }
+    for (c = 0; c < 257; c++)
+        dispatch[c] = lists + c * (num + 1);
+
+    for (p = protocols; p; p = p->next) {
+        if (!p->probe) continue;
+        get_first_bytes(p, set);
+        for (c = 0; c < 256; c++)
+            if (set[c / 8] & (1 << (c % 8)))
+                dispatch[c][count[c]++] = p;
+        dispatch[256][count[256]++] = p;
+    }
+
+    exclusives = calloc(num * num + 1, 1);
+    if (!exclusives) {
+        log_message(LOG_ERR, "out of memory for the probe dispatch table\n");
+        exit(1);
+    }
+    for (p = protocols; p; p = p->next)
+        for (q = protocols; p->probe && q; q = q->next)
+            if (q->probe && are_exclusive(p, q))
+                exclusives[p->index * num + q->index] = 1;
+}
+
+/* Returns the counters of a listening address for the calling thread,
+ * creating them the first time; NULL if there's no listener or no memory */
+static struct probe_stats* get_stats(int listener)
+{
+    struct probe_stats **list, *stats;
+    struct proto **lists;
+    int c;
+
+    if (listener < 0)
+        return NULL;
+
+    if (listener >= num_listener_stats) {
+        list = realloc(listener_stats, (listener + 1) * sizeof(*list));
+        if (!list)
+            return NULL;
+        memset(list + num_listener_stats, 0,
+               (listener + 1 - num_listener_stats) * sizeof(*list));
+        listener_stats = list;
+        num_listener_stats = listener + 1;
+    }
+    if (listener_stats[listener])
+        return listener_stats[listener];
+
+    stats = calloc(1, sizeof(*stats));
+    lists = malloc(257 * (num_probed + 1) * sizeof(*lists));
+    if (stats)
+        stats->hits = calloc(num_probed + 1, sizeof(*stats->hits));
+    if (!stats || !lists || !stats->hits) {
+        if (stats) free(stats->hits);
+        free(stats);
+        free(lists);
+        return NULL;
+    }
+
+    memcpy(lists, dispatch[0], 257 * (num_probed + 1) * sizeof(*lists));
+    for (c = 0; c < 257; c++)
+        stats->dispatch[c] = lists + c * (num_probed + 1);
+    listener_stats[listener] = stats;
+    return stats;
+}
+
+/* Counts a hit of the protocol in candidates[i], and moves it ahead of the
+ * previous one if it has more hits and they can't both match the same data.
+ *
+ * Swapping such probes doesn't change which protocol the data goes to: only
+ * one of them can match, and while one of them needs more data, the data so
+ * far is the beginning of its prefix, so the other one doesn't match (it
+ * differs from that prefix before either ends). Protocols that may both match
+ * never get swapped, so they stay in configuration order. */
+static void count_hit(struct probe_stats *stats, struct proto **candidates, int i)
+{
+    struct proto *p = candidates[i], *prev;
+
+    stats->probed++;
+    stats->hits[p->index]++;
+    if (!i)
+        return;
+
+    prev = candidates[i - 1];
+    if ((stats->hits[p->index] > stats->hits[prev->index]) &&
+        exclusives[p->index * num_probed + prev->index]) {
+        candidates[i - 1] = p;
+        candidates[i] = prev;
+    }
+}
+
+/* 
+ * Checks the data in buf against the probe of each configured protocol, in
+ * order, and returns a pointer to the first protocol that matches. If none
+ * does, returns the first protocol. If a probe can't tell yet, returns NULL
+ * (unless final is set): protocols that come after it can't be tried before
+ * it has decided.
+ * Probes that can't both match are tried in order of hits on the listener
+ * (see count_hit()).
+ */
+struct proto* probe_buffer(const char* buf, int len, int final, int listener)
+{
+    struct regex_scan scan;
+    struct probe_stats *stats = get_stats(listener);
+    struct proto *p, **candidates;
+    int i, c, res;
+
+    if (len >= MAX_PROBE_SIZE)
+        final = 1;
+    scan.scanned = 0;
+
+    /* Only try the probes that can match the first byte */
+    c = len ? (unsigned char)buf[0] : 256;
+    candidates = stats ? stats->dispatch[c] : dispatch[c];
+    for (i = 0; (p = candidates[i]); i++) {
+        if (verbose) fprintf(stderr, "probing for %s\n", p->description);
+        /* Regex probes share one scan of the buffer */
+        if (p->probe == regex_probe)
+            res = regex_set_probe(&scan, buf, len, p->data);
+        else
+            res = p->probe(buf, len, p);
+        if (res == PROBE_MATCH) {
+            if (verbose) fprintf(stderr, "probe %s successful\n", p->description);
+            if (stats)
+                count_hit(stats, candidates, i);
+            return p;
+        }
+        if ((res == PROBE_NEED_MORE) && !final) {
+            if (verbose) fprintf(stderr, "probe %s needs more data\n", p->description);
+            return NULL;
+        }
+    }
 
     if (verbose) 
         fprintf(stderr, 
@@ -251,9 +715,130 @@ struct proto* probe_client_protocol(struct connection *cnx)
 
     /* If none worked, return the first one affected (that's completely
      * arbitrary) */
+    if (stats)
+        stats->probed++;
     return protocols;
 }
 
+#define STATS_LINE  1024
+
+/* Appends to a line of log of STATS_LINE bytes, truncating */
+static void append(char *line, const char *fmt, ...)
+{
+    va_list ap;
+    int n = strlen(line);
+
+    va_start(ap, fmt);
+    vsnprintf(line + n, STATS_LINE - n, fmt, ap);
+    va_end(ap);
+}
+
+/* Do two NULL-terminated lists of protocols have the same order? */
+static int same_order(struct proto **a, struct proto **b)
+{
+    for (; *a && (*a == *b); a++, b++)
+        ;
+    return *a == *b;
+}
+
+void log_probe_stats(void)
+{
+    struct probe_stats *stats;
+    struct proto *p, **list;
+    unsigned long matched;
+    char line[STATS_LINE];
+    int i, c, end;
+
+    for (i = 0; i < num_listener_stats; i++) {
+        stats = listener_stats[i];
+        if (!stats)
+            continue;
+
+        line[0] = 0;
+        matched = 0;
+        for (p = protocols; p; p = p->next) {
+            if (!p->probe) continue;
+            matched += stats->hits[p->index];
+            append(line, ", %s %lu (%lu%%)", p->description, stats->hits[p->index],
+                   stats->probed ? stats->hits[p->index] * 100 / stats->probed : 0);
+        }
+        log_message(LOG_INFO, "probe stats, listener %d: %lu probed, %lu unmatched%s\n",
+                    i, stats->probed, stats->probed - matched, line);
+
+        /* Orders that changed, for runs of first bytes that share them */
+        for (c = 0; c < 257; c = end) {
+            for (end = c + 1; (c < 256) && (end < 256); end++)
+                if (!same_order(stats->dispatch[end], stats->dispatch[c]) ||
+                    !same_order(dispatch[end], dispatch[c]))
+                    break;
+            if (same_order(stats->dispatch[c], dispatch[c]))
+                continue;
+
+            line[0] = 0;
+            if (c == 256)
+                append(line, "no data:");
+            else if (end - c == 1)
+                append(line, "first byte 0x%02x:", c);
+            else
+                append(line, "first bytes 0x%02x-0x%02x:", c, end - 1);
+            for (list = stats->dispatch[c]; *list; list++)
+                append(line, " %s", (*list)->description);
+            log_message(LOG_INFO, "probe order, listener %d, %s\n", i, line);
+        }
+    }
+}
+
+/* 
+ * Read data coming from the client connection and add it to what it sent
+ * before, which waits on the defered write buffer of the connection. Then
+ * check if that's a known protocol, and return a pointer to the protocol
+ * structure, or NULL if more data is needed to tell.
+ */
+struct proto* probe_client_protocol(struct connection *cnx)
+{
+    char buffer[MAX_PROBE_SIZE];
+    const char *data;
+    int n, len;
+
+    defered_block(&cnx->q[1], &len);
+    n = read(cnx->q[0].fd, buffer, MAX_PROBE_SIZE - len);
+    if ((n == -1) && ((errno == EAGAIN) || (errno == EINTR)))
+        return NULL;
+    if ((n > 0) && (defer_write(&cnx->q[1], buffer, n) == -1))
+        n = 0;
+
+    /* It's possible that read() returns an error, e.g. if the client
+     * disconnected between the previous call to select() and now. If that
+     * happens, we just decide with the data we already have or connect to
+     * the default protocol, so the caller of this function does not have to
+     * deal with a specific failure condition (the connection will just fail
+     * later normally). */
+    data = defered_block(&cnx->q[1], &len);
+    if (data)
+        return probe_buffer(data, len, n <= 0, cnx->listener);
+
+    if (verbose) 
+        fprintf(stderr, 
+                "no data to probe, connecting to first protocol: %s\n", 
+                protocols->description);
+
+    return protocols;
+}
+
+/* The probing timeout expired: whatever the client sent so far is all there
+ * is to probe */
+struct proto* probe_timed_out(struct connection *cnx)
+{
+    const char *data;
+    int len;
+
+    data = defered_block(&cnx->q[1], &len);
+    if (data)
+        return probe_buffer(data, len, 1, cnx->listener);
+
+    return timeout_protocol();
+}
+
 /* Returns the structure for specified protocol or NULL if not found */
 static struct proto* get_protocol(const char* description)
 {
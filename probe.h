@@ -4,6 +4,18 @@
 #define __PROBE_H_
 
 #include "common.h"
+#include "probe-plugin.h"
+
+/* Results of a probe (plugins return the same values) */
+enum probe_result {
+    PROBE_NO_MATCH = SSLH_PROBE_NO_MATCH,   /* not this protocol */
+    PROBE_MATCH = SSLH_PROBE_MATCH,         /* this protocol */
+    PROBE_NEED_MORE = SSLH_PROBE_NEED_MORE  /* can't tell yet: try again with more data */
+};
+
+/* Most data read from the client to probe its protocol: probes that still
+ * need more after that don't match */
+#define MAX_PROBE_SIZE  8192
 
 struct proto;
 typedef int T_PROBE(const char*, int, struct proto*);
@@ -15,9 +27,13 @@ struct proto {
     struct addrinfo *saddr; /* list of addresses to try and switch that protocol */
 
     /* function to probe that protocol; parameters are buffer and length
-     * containing the data to probe, and a pointer to the protocol structure */
+     * containing the data to probe (followed by a NUL byte), and a pointer to
+     * the protocol structure. Returns a probe_result. */
     T_PROBE* probe;
-    void* data;     /* opaque pointer ; used to pass list of regex to regex probe */
+    void* data;     /* opaque pointer ; used to pass patterns or routing criteria to the probe */
+    int low_watermark, high_watermark;  /* buffering limits; 0: global setting */
+    int pool_size;  /* number of connections to the server made in advance */
+    int index;      /* position among the protocols that have a probe (set by probe.c) */
     struct proto *next; /* pointer to next protocol in list, NULL if last */
 };
 
@@ -30,6 +46,13 @@ int get_num_builtins(void);
 /* Returns the probe for specified protocol */
 T_PROBE* get_probe(const char* description);
 
+/* load_probe_plugin
+ *
+ * Sets the probe of p to the one of the plugin in the shared object at path
+ * (see probe-plugin.h). Returns 0, or -1 (after saying why) if it can't.
+ */
+int load_probe_plugin(struct proto *p, const char *path);
+
 /* Returns the head of the configured protocols */
 struct proto* get_first_protocol(void);
 
@@ -38,13 +61,39 @@ void set_protocol_list(struct proto*);
 
 /* probe_client_protocol
  *
- * Read the beginning of data coming from the client connection and check if
- * it's a known protocol. Then leave the data on the defered
- * write buffer of the connection and returns a pointer to the protocol
- * structure
+ * Read data coming from the client connection and check if what it sent so
+ * far is a known protocol. The data is left on the defered write buffer of
+ * the connection. Returns a pointer to the protocol structure, or NULL if a
+ * probe needs more data to decide (call again once more data arrives).
  */
 struct proto* probe_client_protocol(struct connection *cnx);
 
+/* probe_timed_out
+ *
+ * The probing timeout expired: returns the protocol matching what the client
+ * sent so far, or the timeout protocol if it sent nothing
+ */
+struct proto* probe_timed_out(struct connection *cnx);
+
+/* probe_buffer
+ *
+ * Probe data that has already been read from the client (buf[len] must be a
+ * NUL byte) and return a pointer to the protocol structure (the first
+ * protocol if no probe matches), or NULL if a probe needs more data to decide.
+ * If final is set, or len reaches MAX_PROBE_SIZE, no more data is coming and
+ * probes that need more count as not matching.
+ * listener is the index of the listening address the client connected to, for
+ * the hit counters (-1 if none: the probes are tried in configuration order).
+ */
+struct proto* probe_buffer(const char* buf, int len, int final, int listener);
+
+/* log_probe_stats
+ *
+ * Logs the hit counters and the current order of the probes of each listening
+ * address, as seen by the calling thread
+ */
+void log_probe_stats(void);
+
 /* set the protocol to connect to in case of timeout */
 void set_ontimeout(const char* name);
 
@@ -0,0 +1,359 @@
+/*
+# regex-set.c: matching of all the regular expression probes at once
+#
+# Copyright (C) 2007-2012  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+#include <stdint.h>
+#include <ctype.h>
+#include "regex-set.h"
+
+/* A pattern is only tried with regexec() if the buffer contains a string that
+ * all its matches contain (its literal). The literals of all the patterns are
+ * looked for at once with an Aho-Corasick automaton, so the buffer is scanned
+ * once whatever the number of patterns. Patterns we can't find a literal for
+ * are always tried. */
+
+/* Longest literal kept for a pattern (any part of a literal will do, and
+ * longer ones only make the automaton bigger) */
+#define MAX_LITERAL     8
+
+#define SET_BIT(map, i)     ((map)[(i) / 8] |= 1 << ((i) % 8))
+#define TEST_BIT(map, i)    ((map)[(i) / 8] & (1 << ((i) % 8)))
+
+struct pattern {
+    regex_t *re;
+    char literal[MAX_LITERAL];
+    int literal_len;
+    char prefix[MAX_LITERAL];   /* what the data must start with */
+    int prefix_len;
+    int next_out;   /* next pattern whose literal ends in the same state, or -1 */
+};
+
+static struct pattern patterns[MAX_REGEX_PATTERNS];
+static int num_patterns;
+static unsigned char always[MAX_REGEX_PATTERNS / 8];   /* patterns without literal */
+
+/* The automaton; state 0 is the start. NULL until it is built. */
+static uint16_t (*next_state)[256];
+static int *state_out;      /* first pattern whose literal ends in that state, or -1 */
+static uint16_t *out_link;  /* next state with an output down the failure links, 0 if none */
+
+
+/* Skips a bracket expression starting at p[0] ('['); returns NULL if it
+ * doesn't end */
+static const char* skip_bracket(const char *p)
+{
+    p++;
+    if (*p == '^') p++;
+    if (*p == ']') p++;
+    while (*p && (*p != ']')) {
+        if ((*p == '[') && ((p[1] == ':') || (p[1] == '=') || (p[1] == '.'))) {
+            /* [:class:], [=equiv=] or [.coll.] */
+            p = strchr(p + 2, ']');
+            if (!p) return NULL;
+        }
+        p++;
+    }
+    return *p ? p + 1 : NULL;
+}
+
+/* If p points to a quantifier, returns where it ends; otherwise returns p */
+static const char* skip_quantifier(const char *p)
+{
+    if (*p == '*')
+        return p + 1;
+    if ((p[0] == '\\') && ((p[1] == '+') || (p[1] == '?')))
+        return p + 2;
+    if ((p[0] == '\\') && (p[1] == '{')) {
+        p = strstr(p, "\\}");
+        return p ? p + 2 : p;
+    }
+    return p;
+}
+
+/* Finds a string that all matches of the basic regular expression expr
+ * contain, and copies up to MAX_LITERAL bytes of it to literal. Returns its
+ * length, or 0 if there's none we can be sure of. Only plain characters
+ * outside of groups are taken; anything else ends the string. */
+static int required_literal(const char *expr, char *literal)
+{
+    char run[MAX_LITERAL];
+    int run_len = 0, best_len = 0, depth = 0, c;
+    const char *p = expr, *q;
+
+    while (*p) {
+        c = -1;
+        if (*p == '\\') {
+            p++;
+            switch (*p) {
+            case '(':
+                depth++;
+                break;
+            case ')':
+                depth--;
+                break;
+            case '|':   /* alternation (GNU extension) */
+            case 0:
+                return 0;
+            case '{': case '+': case '?': case '}':
+                /* Quantifier where we don't expect one */
+                return 0;
+            case 'w': case 'W': case 's': case 'S': case 'b': case 'B':
+            case '<': case '>': case '`': case '\'':
+            case '1': case '2': case '3': case '4': case '5':
+            case '6': case '7': case '8': case '9':
+                /* Classes, anchors and back-references (GNU extensions) */
+                break;
+            default:
+                c = (unsigned char)*p;
+            }
+            p++;
+        } else if (*p == '[') {
+            p = skip_bracket(p);
+            if (!p) return 0;
+        } else if ((*p == '.') || (*p == '*') || (*p == '^') || (*p == '$')) {
+            p++;
+        } else {
+            c = (unsigned char)*p++;
+        }
+
+        /* A repeated atom may not be there at all */
+        q = skip_quantifier(p);
+        if (!q) return 0;
+        if (q != p) {
+            c = -1;
+            p = q;
+        }
+
+        if ((c >= 0) && !depth) {
+            if (run_len < MAX_LITERAL)
+                run[run_len++] = c;
+        } else {
+            if (run_len > best_len) {
+                memcpy(literal, run, run_len);
+                best_len = run_len;
+            }
+            run_len = 0;
+        }
+    }
+    if (run_len > best_len) {
+        memcpy(literal, run, run_len);
+        best_len = run_len;
+    }
+    return best_len;
+}
+
+/* Finds the string that all matches of the basic regular expression expr
+ * start with, and copies up to MAX_LITERAL bytes of it to prefix. Returns its
+ * length, or 0 if there's none we can be sure of. */
+static int leading_literal(const char *expr, char *prefix)
+{
+    const char *p = expr + 1;
+    int len = 0, c;
+
+    if ((expr[0] != '^') || strstr(expr, "\\|"))
+        return 0;
+
+    while (len < MAX_LITERAL) {
+        if (*p == '\\') {
+            /* Escaped character: only punctuation is a plain character for sure */
+            if (!p[1] || isalnum((unsigned char)p[1]) || strchr("(){}|+?<>`'", p[1]))
+                break;
+            c = (unsigned char)p[1];
+            p += 2;
+        } else if (*p && !strchr(".[*$", *p)) {
+            c = (unsigned char)*p++;
+        } else {
+            break;
+        }
+
+        /* It's not there for sure if it's repeated */
+        if (skip_quantifier(p) != p)
+            break;
+        prefix[len++] = c;
+    }
+    return len;
+}
+
+struct regex_range* regex_set_add(struct regex_range *range, regex_t *re, const char *expr)
+{
+    struct pattern *pat;
+
+    if (num_patterns == MAX_REGEX_PATTERNS)
+        return NULL;
+
+    if (!range) {
+        range = calloc(1, sizeof(*range));
+        if (!range) {
+            log_message(LOG_ERR, "out of memory for regex probes\n");
+            exit(1);
+        }
+        range->first = num_patterns;
+    }
+    pat = &patterns[num_patterns++];
+    range->num++;
+
+    pat->re = re;
+    pat->literal_len = required_literal(expr, pat->literal);
+    pat->prefix_len = leading_literal(expr, pat->prefix);
+    return range;
+}
+
+int regex_set_first_bytes(const struct regex_range *range, unsigned char *set)
+{
+    int i;
+
+    memset(set, 0, 32);
+    for (i = range->first; i < range->first + range->num; i++) {
+        if (!patterns[i].prefix_len)
+            return 0;
+        SET_BIT(set, (unsigned char)patterns[i].prefix[0]);
+    }
+    return 1;
+}
+
+const char* regex_set_prefix(const struct regex_range *range, int i, int *len)
+{
+    int j;
+
+    for (j = range->first; j < range->first + range->num; j++)
+        if (!patterns[j].prefix_len)
+            return NULL;
+    if (i >= range->num)
+        return NULL;
+
+    *len = patterns[range->first + i].prefix_len;
+    return patterns[range->first + i].prefix;
+}
+
+void regex_set_build(void)
+{
+    int max_states = 1, num_states = 1, i, j, s, t, c, head, tail;
+    uint16_t *fail, *queue;
+    struct pattern *pat;
+
+    for (i = 0; i < num_patterns; i++)
+        max_states += patterns[i].literal_len;
+
+    next_state = calloc(max_states, sizeof(*next_state));
+    state_out = malloc(max_states * sizeof(*state_out));
+    out_link = calloc(max_states, sizeof(*out_link));
+    fail = calloc(max_states, sizeof(*fail));
+    queue = calloc(max_states, sizeof(*queue));
+    if (!next_state || !state_out || !out_link || !fail || !queue) {
+        /* Patterns keep being tried one by one (see scan_buffer()) */
+        log_message(LOG_ERR, "out of memory for the regex probe automaton\n");
+        free(next_state);
+        free(state_out);
+        free(out_link);
+        free(fail);
+        free(queue);
+        next_state = NULL;
+        state_out = NULL;
+        out_link = NULL;
+        return;
+    }
+    for (s = 0; s < max_states; s++)
+        state_out[s] = -1;
+
+    /* Trie of the literals */
+    for (i = 0; i < num_patterns; i++) {
+        pat = &patterns[i];
+        if (!pat->literal_len) {
+            SET_BIT(always, i);
+            continue;
+        }
+        for (s = 0, j = 0; j < pat->literal_len; j++) {
+            c = (unsigned char)pat->literal[j];
+            if (!next_state[s][c])
+                next_state[s][c] = num_states++;
+            s = next_state[s][c];
+        }
+        pat->next_out = state_out[s];
+        state_out[s] = i;
+    }
+
+    /* Failure links, breadth-first; missing transitions go where the
+     * failure link's do */
+    head = tail = 0;
+    for (c = 0; c < 256; c++)
+        if (next_state[0][c])
+            queue[tail++] = next_state[0][c];
+    while (head < tail) {
+        s = queue[head++];
+        out_link[s] = state_out[fail[s]] >= 0 ? fail[s] : out_link[fail[s]];
+        for (c = 0; c < 256; c++) {
+            t = next_state[s][c];
+            if (t) {
+                fail[t] = next_state[fail[s]][c];
+                queue[tail++] = t;
+            } else {
+                next_state[s][c] = next_state[fail[s]][c];
+            }
+        }
+    }
+
+    free(fail);
+    free(queue);
+
+    if (verbose)
+        fprintf(stderr, "regex probes: %d patterns, %d states\n", num_patterns, num_states);
+}
+
+/* Finds the patterns whose literal is in buf[0..len[ */
+static void scan_buffer(struct regex_scan *scan, const char *buf, int len)
+{
+    const unsigned char *p = (const unsigned char*)buf, *end = p + len;
+    int s = 0, t, i;
+
+    scan->scanned = 1;
+    if (!next_state) {
+        memset(scan->candidates, 0xFF, sizeof(scan->candidates));
+        return;
+    }
+
+    memcpy(scan->candidates, always, sizeof(always));
+    for (; p < end; p++) {
+        s = next_state[s][*p];
+        for (t = state_out[s] >= 0 ? s : out_link[s]; t; t = out_link[t])
+            for (i = state_out[t]; i >= 0; i = patterns[i].next_out)
+                SET_BIT(scan->candidates, i);
+    }
+}
+
+int regex_set_probe(struct regex_scan *scan, const char *buf, int len,
+                    const struct regex_range *range)
+{
+    regmatch_t match;
+    int i;
+
+    if (!scan->scanned)
+        scan_buffer(scan, buf, len);
+
+    for (i = range->first; i < range->first + range->num; i++) {
+        if (!TEST_BIT(scan->candidates, i))
+            continue;
+        /* Match within the data read, which may contain NUL bytes */
+        match.rm_so = 0;
+        match.rm_eo = len;
+        if (!regexec(patterns[i].re, buf, 1, &match, REG_STARTEND))
+            return 1;
+    }
+    return 0;
+}
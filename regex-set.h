@@ -0,0 +1,65 @@
+/* API for regex-set.c */
+
+#ifndef __REGEX_SET_H_
+#define __REGEX_SET_H_
+
+#include <regex.h>
+#include "common.h"
+
+/* Most regular expressions in all the probes of the configuration */
+#define MAX_REGEX_PATTERNS  1024
+
+/* Patterns of the regex probe of a protocol (kept in proto->data) */
+struct regex_range {
+    int first, num;
+};
+
+/* Patterns that may match a buffer. The buffer is scanned once for all the
+ * patterns of the configuration, the first time a regex probe looks at it;
+ * set scanned to 0 before probing a new buffer. */
+struct regex_scan {
+    int scanned;
+    unsigned char candidates[MAX_REGEX_PATTERNS / 8];
+};
+
+/* regex_set_add
+ *
+ * Adds a compiled basic regular expression (expr is its source) to the regex
+ * probe of a protocol; all patterns of a protocol must be added in a row.
+ * Returns the range of patterns of the protocol, or NULL if there are too
+ * many patterns.
+ */
+struct regex_range* regex_set_add(struct regex_range *range, regex_t *re, const char *expr);
+
+/* regex_set_build
+ *
+ * Builds the automaton that looks for all patterns at once. Call once all
+ * patterns have been added; until then, all patterns are tried one by one.
+ */
+void regex_set_build(void);
+
+/* regex_set_first_bytes
+ *
+ * Sets the bytes the data must start with for one of the patterns of range
+ * to match in set (a 256-bit bitmap). Returns 0 if it could start with
+ * anything as far as we can tell.
+ */
+int regex_set_first_bytes(const struct regex_range *range, unsigned char *set);
+
+/* regex_set_prefix
+ *
+ * Returns the string the data must start with for the i-th pattern of range
+ * to match, and sets *len to its length. Returns NULL if i is past the last
+ * pattern, or if one of the patterns could match data that starts with
+ * anything as far as we can tell.
+ */
+const char* regex_set_prefix(const struct regex_range *range, int i, int *len);
+
+/* regex_set_probe
+ *
+ * Does one of the patterns of range match buf[0..len[ ? Returns 0 or 1.
+ */
+int regex_set_probe(struct regex_scan *scan, const char *buf, int len,
+                    const struct regex_range *range);
+
+#endif
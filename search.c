@@ -0,0 +1,148 @@
+/*
+# search.c: length-bounded string matching for the probes
+#
+# Copyright (C) 2007-2012  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+#include <stdint.h>
+#include "search.h"
+
+/* On x86, substrings are looked for 64 positions at a time, with SSE2 or
+ * AVX2 if the CPU has it */
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#include <immintrin.h>
+#define SEARCH_X86
+#endif
+
+int match_prefix(const char *p, int len, const char *prefix, int prefix_len)
+{
+    if (len < prefix_len)
+        return memcmp(p, prefix, len) ? -1 : 0;
+    return memcmp(p, prefix, prefix_len) ? -1 : 1;
+}
+
+/* Looks for s from p[i] on, one position at a time */
+static const char* find_from(const char *p, int len, int i, const char *s, int s_len)
+{
+    const char *c, *last = p + len - s_len;
+
+    for (c = p + i; c <= last; c++) {
+        c = memchr(c, s[0], last - c + 1);
+        if (!c)
+            return NULL;
+        if (!memcmp(c + 1, s + 1, s_len - 1))
+            return c;
+    }
+    return NULL;
+}
+
+#ifdef SEARCH_X86
+/* Checks the positions of p set in mask (where the first and last bytes of s
+ * are where they should) for the rest of s */
+static const char* check_candidates(const char *p, uint64_t mask, const char *s, int s_len)
+{
+    int bit;
+
+    for (; mask; mask &= mask - 1) {
+        bit = __builtin_ctzll(mask);
+        if (!memcmp(p + bit + 1, s + 1, s_len - 1))
+            return p + bit;
+    }
+    return NULL;
+}
+
+/* find_sse2() and find_avx2() look for s from position *i, 64 or 128
+ * positions at a time, as long as that stays within p[0..len[; if they don't
+ * find it, they set *i to the first position they didn't check. */
+static const char* find_sse2(const char *p, int len, int *i, const char *s, int s_len)
+{
+    __m128i first = _mm_set1_epi8(s[0]), last = _mm_set1_epi8(s[s_len - 1]), eq[4];
+    const char *q, *found, *end = p + len - (s_len - 1);
+    uint64_t mask;
+    int k;
+
+    for (q = p + *i; end - q >= 64; q += 64) {
+        for (k = 0; k < 4; k++)
+            eq[k] = _mm_and_si128(
+                _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i*)(q + 16 * k))),
+                _mm_cmpeq_epi8(last, _mm_loadu_si128((const __m128i*)(q + 16 * k + s_len - 1))));
+        /* Most of the time, there's no candidate at all */
+        if (!_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(eq[0], eq[1]),
+                                            _mm_or_si128(eq[2], eq[3]))))
+            continue;
+
+        for (mask = 0, k = 0; k < 4; k++)
+            mask |= (uint64_t)(unsigned)_mm_movemask_epi8(eq[k]) << (16 * k);
+        if ((found = check_candidates(q, mask, s, s_len)))
+            return found;
+    }
+    *i = q - p;
+    return NULL;
+}
+
+__attribute__((target("avx2")))
+static const char* find_avx2(const char *p, int len, int *i, const char *s, int s_len)
+{
+    __m256i first = _mm256_set1_epi8(s[0]), last = _mm256_set1_epi8(s[s_len - 1]), eq[4], any;
+    const char *q, *found, *end = p + len - (s_len - 1);
+    uint64_t mask;
+    int k;
+
+    for (q = p + *i; end - q >= 128; q += 128) {
+        for (k = 0; k < 4; k++)
+            eq[k] = _mm256_and_si256(
+                _mm256_cmpeq_epi8(first, _mm256_loadu_si256((const __m256i*)(q + 32 * k))),
+                _mm256_cmpeq_epi8(last, _mm256_loadu_si256((const __m256i*)(q + 32 * k + s_len - 1))));
+        any = _mm256_or_si256(_mm256_or_si256(eq[0], eq[1]), _mm256_or_si256(eq[2], eq[3]));
+        if (_mm256_testz_si256(any, any))
+            continue;
+
+        for (k = 0; k < 4; k += 2) {
+            mask = (unsigned)_mm256_movemask_epi8(eq[k]) |
+                (uint64_t)(unsigned)_mm256_movemask_epi8(eq[k + 1]) << 32;
+            if ((found = check_candidates(q + 32 * k, mask, s, s_len)))
+                return found;
+        }
+    }
+    *i = q - p;
+    return NULL;
+}
+#endif
+
+const char* find_string(const char *p, int len, const char *s, int s_len)
+{
+    const char *found;
+    int i = 0;
+
+    if (s_len > len)
+        return NULL;
+    if (!s_len)
+        return p;
+
+#ifdef SEARCH_X86
+    if (__builtin_cpu_supports("avx2"))
+        found = find_avx2(p, len, &i, s, s_len);
+    else
+        found = find_sse2(p, len, &i, s, s_len);
+    if (found)
+        return found;
+#endif
+
+    /* What's left (or everything, elsewhere) */
+    return find_from(p, len, i, s, s_len);
+}
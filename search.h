@@ -0,0 +1,30 @@
+/* API for search.c */
+
+#ifndef __SEARCH_H_
+#define __SEARCH_H_
+
+#include "common.h"
+
+/* A constant string and its length, for tables of strings to look for */
+struct string {
+    const char *s;
+    int len;
+};
+#define STRING(s)   { s, sizeof(s) - 1 }
+
+/* match_prefix
+ *
+ * Does p[0..len[ start with prefix[0..prefix_len[ ? Returns 1 if it does, 0
+ * if p is shorter than the prefix but matches so far, and -1 otherwise.
+ */
+int match_prefix(const char *p, int len, const char *prefix, int prefix_len);
+
+/* find_string
+ *
+ * Returns a pointer to the first occurrence of s[0..s_len[ in p[0..len[, or
+ * NULL if there is none. Reads nothing outside of p[0..len[, and NUL bytes
+ * are data like any other.
+ */
+const char* find_string(const char *p, int len, const char *s, int s_len);
+
+#endif
@@ -0,0 +1,189 @@
+/*
+# slab.c: pool allocator for fixed-size objects
+#
+# Copyright (C) 2007-2012  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <sys/mman.h>
+#include "slab.h"
+
+/* Each slab is a block of slab_size bytes, aligned on slab_size, so the slab
+ * an object belongs to is found by masking its address. Free objects of a
+ * slab are chained through their first bytes. Slabs are mapped directly (not
+ * malloc'ed) so they really go back to the system when released. */
+
+/* Minimum number of objects in a slab; slabs are made of as many pages as
+ * needed to hold that many */
+#define MIN_OBJS_PER_SLAB   16
+
+/* Objects are aligned on this (callers use the low bits of object pointers
+ * as tags) */
+#define OBJ_ALIGN           16
+
+struct free_obj {
+    struct free_obj *next;
+};
+
+struct slab {
+    struct slab *prev, *next;   /* in the pool's partial or empty list */
+    struct free_obj *free_list;
+    int used;
+    int in_partial;             /* on the partial list (otherwise empty or full) */
+    char objs[] __attribute__((aligned(OBJ_ALIGN)));
+};
+
+static void slab_unlink(struct slab **head, struct slab *s)
+{
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        *head = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    s->prev = s->next = NULL;
+}
+
+static void slab_push(struct slab **head, struct slab *s)
+{
+    s->prev = NULL;
+    s->next = *head;
+    if (*head)
+        (*head)->prev = s;
+    *head = s;
+}
+
+void slab_pool_init(struct slab_pool *pool, size_t obj_size)
+{
+    size_t page = getpagesize();
+
+    memset(pool, 0, sizeof(*pool));
+    pool->obj_size = (obj_size + OBJ_ALIGN - 1) & ~(size_t)(OBJ_ALIGN - 1);
+
+    pool->slab_size = page;
+    while ((pool->slab_size - sizeof(struct slab)) / pool->obj_size < MIN_OBJS_PER_SLAB)
+        pool->slab_size *= 2;
+    pool->objs_per_slab = (pool->slab_size - sizeof(struct slab)) / pool->obj_size;
+}
+
+/* Maps a new slab, aligned on its size */
+static struct slab* new_slab(struct slab_pool *pool)
+{
+    char *mem, *aligned;
+    size_t size = pool->slab_size;
+    struct slab *s;
+    struct free_obj *o;
+    int i;
+
+    mem = mmap(NULL, size * 2, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    /* Trim what's around the aligned block */
+    aligned = (char*)(((uintptr_t)mem + size - 1) & ~(uintptr_t)(size - 1));
+    if (aligned > mem)
+        munmap(mem, aligned - mem);
+    munmap(aligned + size, mem + size - aligned);
+
+    s = (struct slab*)aligned;
+    s->prev = s->next = NULL;
+    s->used = 0;
+    s->in_partial = 0;
+    s->free_list = NULL;
+    for (i = pool->objs_per_slab - 1; i >= 0; i--) {
+        o = (struct free_obj*)(s->objs + i * pool->obj_size);
+        o->next = s->free_list;
+        s->free_list = o;
+    }
+
+    if (verbose)
+        fprintf(stderr, "new slab of %d objects\n", pool->objs_per_slab);
+
+    return s;
+}
+
+void* slab_alloc(struct slab_pool *pool)
+{
+    struct slab *s;
+    struct free_obj *o;
+
+    s = pool->partial;
+    if (!s) {
+        /* Re-use an empty slab, or map a new one */
+        s = pool->empty;
+        if (s) {
+            slab_unlink(&pool->empty, s);
+            pool->num_empty--;
+        } else {
+            s = new_slab(pool);
+            if (!s) return NULL;
+        }
+        slab_push(&pool->partial, s);
+        s->in_partial = 1;
+    }
+
+    o = s->free_list;
+    s->free_list = o->next;
+    s->used++;
+
+    if (!s->free_list) {
+        /* Slab is full: it leaves the partial list until something is freed */
+        slab_unlink(&pool->partial, s);
+        s->in_partial = 0;
+    }
+
+    return o;
+}
+
+void slab_free(struct slab_pool *pool, void *obj)
+{
+    struct slab *s = (struct slab*)((uintptr_t)obj & ~(uintptr_t)(pool->slab_size - 1));
+    struct free_obj *o = obj;
+
+    o->next = s->free_list;
+    s->free_list = o;
+    s->used--;
+
+    if (!s->used) {
+        if (s->in_partial)
+            slab_unlink(&pool->partial, s);
+        s->in_partial = 0;
+        slab_push(&pool->empty, s);
+        pool->num_empty++;
+    } else if (!s->in_partial) {
+        /* Slab was full */
+        slab_push(&pool->partial, s);
+        s->in_partial = 1;
+    }
+}
+
+void slab_trim(struct slab_pool *pool)
+{
+    struct slab *s;
+
+    while (pool->num_empty > 1) {
+        s = pool->empty;
+        slab_unlink(&pool->empty, s);
+        pool->num_empty--;
+        munmap(s, pool->slab_size);
+        if (verbose)
+            fprintf(stderr, "released slab\n");
+    }
+}
@@ -0,0 +1,39 @@
+/* API for slab.c */
+
+#ifndef __SLAB_H_
+#define __SLAB_H_
+
+#include "common.h"
+
+struct slab;
+
+/* A pool of fixed-size objects (e.g. connections). Objects are carved out of
+ * slabs of a few pages and never move, so pointers to them stay valid for as
+ * long as they are allocated. A pool is not thread-safe: each thread should
+ * use its own. */
+struct slab_pool {
+    size_t obj_size;
+    int objs_per_slab;
+    size_t slab_size;
+
+    struct slab *partial;   /* slabs with at least one free object */
+    struct slab *empty;     /* slabs with no object in use */
+    int num_empty;
+};
+
+/* Prepares a pool of objects of obj_size bytes */
+void slab_pool_init(struct slab_pool *pool, size_t obj_size);
+
+/* Returns a new object (not initialised), or NULL if out of memory */
+void* slab_alloc(struct slab_pool *pool);
+
+/* Gives an object back to the pool. The memory stays mapped until the next
+ * call to slab_trim(), so stale references can still be looked at until
+ * then (only the first pointer-sized bytes of the object are overwritten) */
+void slab_free(struct slab_pool *pool, void *obj);
+
+/* Returns slabs that have no object in use to the system, keeping one of them
+ * for the next allocations */
+void slab_trim(struct slab_pool *pool);
+
+#endif
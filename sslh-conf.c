@@ -0,0 +1,754 @@
+/*
+# sslh-conf: processing of config file and command line options
+#
+# Copyright (C) 2007-2012  Yves Rutschle
+# 
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+# 
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+# 
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+
+*/
+
+#define _GNU_SOURCE
+#ifdef LIBCONFIG
+#include <libconfig.h>
+#endif
+#include <regex.h>
+
+#include "common.h"
+#include "probe.h"
+#include "tls.h"
+#include "http.h"
+#include "regex-set.h"
+
+const char* USAGE_STRING =
+"sslh " VERSION "\n" \
+"usage:\n" \
+"\tsslh  [-v] [-i] [-V] [-f] [-n] [--splice] [--defer-accept] [-F <file>]\n"
+"\t[-t <timeout>] [-P <pidfile>] -u <username> -p <add> [-p <addr> ...] \n" \
+"\t[--threads <num>] [--backlog <num>] [--accept-batch <num>]\n" \
+"\t[--relay-budget <bytes>] [--low-watermark <bytes>] [--high-watermark <bytes>]\n" \
+"\t[--prefork] [--min-spare-workers <num>] [--max-spare-workers <num>]\n" \
+"\t[--max-workers <num>] [--max-worker-connections <num>] [--http-header-limit <bytes>]\n" \
+"%s\n\n" /* Dynamically built list of builtin protocols */  \
+"\t[--on-timeout <addr>]\n" \
+"-v: verbose\n" \
+"-V: version\n" \
+"-f: foreground\n" \
+"-n: numeric output\n" \
+"--splice: relay data with splice(2), without copying it to user space.\n" \
+"--defer-accept: only accept connections once the client sent data or the timeout is over.\n" \
+"-F: use configuration file\n" \
+"--on-timeout: connect to specified address upon timeout (default: ssh address)\n" \
+"-t: seconds to wait before connecting to --on-timeout address (can be fractional).\n" \
+"-p: address and port to listen on.\n    Can be used several times to bind to several addresses.\n" \
+"--threads: number of workers, each with its own listening sockets.\n" \
+"--backlog: length of the queue of pending connections of listening sockets.\n" \
+"--accept-batch: maximum number of connections accepted at once (sslh-select).\n" \
+"--relay-budget: maximum number of bytes relayed at once for a connection (sslh-select).\n" \
+"--high-watermark: stop reading from one side when that much data waits for the other (sslh-select).\n" \
+"--low-watermark: resume reading when waiting data falls to that (sslh-select).\n" \
+"--prefork: serve connections from a pool of worker processes (sslh-fork).\n" \
+"--min-spare-workers, --max-spare-workers: number of idle workers to keep (sslh-fork).\n" \
+"--max-workers: maximum number of workers (sslh-fork).\n" \
+"--max-worker-connections: connections served by a worker before it is replaced (0: no limit).\n" \
+"--http-header-limit: most request data read to route HTTP on host or path.\n" \
+"--[ssh,ssl,...]: where to connect connections from corresponding protocol.\n" \
+"-F: specify a configuration file\n" \
+"-P: PID file.\n" \
+"-i: Run as a inetd service.\n" \
+"";
+
+/* Constants for options that have no one-character shorthand */
+#define OPT_ONTIMEOUT   257
+#define OPT_THREADS     258
+#define OPT_BACKLOG     259
+#define OPT_ACCEPTBATCH 260
+#define OPT_RELAYBUDGET 261
+#define OPT_LOWWATER    262
+#define OPT_HIGHWATER   263
+#define OPT_MINSPARE    264
+#define OPT_MAXSPARE    265
+#define OPT_MAXWORKERS  266
+#define OPT_WORKERCNX   267
+#define OPT_HTTPLIMIT   268
+
+static struct option const_options[] = {
+    { "inetd",      no_argument,            &inetd,         1 },
+    { "foreground", no_argument,            &foreground,    1 },
+    { "background", no_argument,            &background,    1 },
+    { "numeric",    no_argument,            &numeric,       1 },
+    { "splice",     no_argument,            &use_splice,    1 },
+    { "defer-accept", no_argument,          &defer_accept,  1 },
+    { "prefork",    no_argument,            &prefork,       1 },
+    { "verbose",    no_argument,            &verbose,       1 },
+    { "user",       required_argument,      0,              'u' },
+    { "config",     required_argument,      0,              'F' },
+    { "pidfile",    required_argument,      0,              'P' },
+    { "timeout",    required_argument,      0,              't' },
+    { "on-timeout", required_argument,      0,              OPT_ONTIMEOUT },
+    { "threads",    required_argument,      0,              OPT_THREADS },
+    { "backlog",    required_argument,      0,              OPT_BACKLOG },
+    { "accept-batch", required_argument,    0,              OPT_ACCEPTBATCH },
+    { "relay-budget", required_argument,    0,              OPT_RELAYBUDGET },
+    { "low-watermark", required_argument,   0,              OPT_LOWWATER },
+    { "high-watermark", required_argument,  0,              OPT_HIGHWATER },
+    { "min-spare-workers", required_argument, 0,            OPT_MINSPARE },
+    { "max-spare-workers", required_argument, 0,            OPT_MAXSPARE },
+    { "max-workers", required_argument,     0,              OPT_MAXWORKERS },
+    { "max-worker-connections", required_argument, 0,       OPT_WORKERCNX },
+    { "http-header-limit", required_argument, 0,            OPT_HTTPLIMIT },
+    { "listen",     required_argument,      0,              'p' },
+    {}
+};
+static struct option* all_options;
+static struct proto* builtins;
+static const char *optstr = "vt:T:p:VP:F:";
+
+
+
+static void print_usage(void)
+{
+    struct proto *p;
+    int i;
+    char *prots = "";
+
+    p = get_builtins();
+    for (i = 0; i < get_num_builtins(); i++)
+        asprintf(&prots, "%s\t[--%s <addr>]\n", prots, p[i].description);
+
+    fprintf(stderr, USAGE_STRING, prots);
+}
+
+void printsettings(void)
+{
+    char buf[NI_MAXHOST];
+    struct addrinfo *a;
+    struct proto *p;
+    
+    for (p = get_first_protocol(); p; p = p->next) {
+        fprintf(stderr,
+                "%s addr: %s. libwrap service: %s family %d %d pool %d\n", 
+                p->description, 
+                sprintaddr(buf, sizeof(buf), p->saddr), 
+                p->service,
+                p->saddr->ai_family,
+                p->saddr->ai_addr->sa_family,
+                p->pool_size);
+    }
+    fprintf(stderr, "listening on:\n");
+    for (a = addr_listen; a; a = a->ai_next) {
+        fprintf(stderr, "\t%s\n", sprintaddr(buf, sizeof(buf), a));
+    }
+    fprintf(stderr, "timeout: %g\non-timeout: %s\n", probing_timeout,
+            timeout_protocol()->description);
+    fprintf(stderr, "defer-accept: %d\n", defer_accept);
+    fprintf(stderr, "threads: %d\n", num_threads);
+    fprintf(stderr, "backlog: %d\naccept-batch: %d\n", listen_backlog, accept_batch);
+    fprintf(stderr, "relay-budget: %d\n", relay_budget);
+    fprintf(stderr, "http-header-limit: %d\n", http_header_limit);
+    fprintf(stderr, "watermarks: %d-%d\n", low_watermark, high_watermark);
+    fprintf(stderr, "prefork: %d\nspare workers: %d-%d\nmax-workers: %d\nmax-worker-connections: %d\n",
+            prefork, min_spare_workers, max_spare_workers, max_workers, max_worker_connections);
+}
+
+
+/* Extract configuration on addresses and ports on which to listen.
+ * out: newly allocated list of addrinfo to listen to
+ */
+#ifdef LIBCONFIG
+static int config_listen(config_t *config, struct addrinfo **listen) 
+{
+    config_setting_t *setting, *addr;
+    int len, i;
+    const char *hostname, *port;
+
+    setting = config_lookup(config, "listen");
+    if (setting) {
+        len = config_setting_length(setting);
+        for (i = 0; i < len; i++) {
+            addr = config_setting_get_elem(setting, i);
+            if (! (config_setting_lookup_string(addr, "host", &hostname) &&
+                   config_setting_lookup_string(addr, "port", &port))) {
+                fprintf(stderr,
+                            "line %d:Incomplete specification (hostname and port required)\n",
+                            config_setting_source_line(addr));
+                return -1;
+            }
+
+            resolve_split_name(listen, hostname, port);
+
+            /* getaddrinfo returned a list of addresses corresponding to the
+             * specification; move the pointer to the end of that list before
+             * processing the next specification */
+            for (; *listen; listen = &((*listen)->ai_next));
+        }
+    }
+
+    return 0;
+}
+#endif
+
+
+
+#ifdef LIBCONFIG
+static void setup_regex_probe(struct proto *p, config_setting_t* probes)
+{
+    int num_probes, errsize, i, res;
+    char *err;
+    const char * expr;
+    regex_t* re;
+
+    num_probes = config_setting_length(probes);
+    if (!num_probes) {
+        fprintf(stderr, "%s: no probes specified\n", p->description);
+        exit(1);
+    }
+
+    p->probe = get_probe("regex");
+
+    for (i = 0; i < num_probes; i++) {
+        re = malloc(sizeof(*re));
+        expr = config_setting_get_string_elem(probes, i);
+        res = regcomp(re, expr, 0);
+        if (res) {
+            err = malloc(errsize = regerror(res, re, NULL, 0));
+            regerror(res, re, err, errsize);
+            fprintf(stderr, "%s:%s\n", expr, err);
+            free(err);
+            exit(1);
+        }
+        p->data = regex_set_add(p->data, re, expr);
+        if (!p->data) {
+            fprintf(stderr, "%s: too many regex probes (at most %d)\n", p->description, MAX_REGEX_PATTERNS);
+            exit(1);
+        }
+    }
+}
+#endif
+
+#ifdef LIBCONFIG
+/* Returns a newly-allocated, NULL-terminated array of the strings in the list
+ * setting name of prot, or NULL if there is no such setting */
+static const char** config_string_list(config_setting_t *prot, const char *name)
+{
+    config_setting_t *setting;
+    const char **list;
+    int num, i;
+
+    setting = config_setting_get_member(prot, name);
+    if (!setting)
+        return NULL;
+
+    num = config_setting_length(setting);
+    list = calloc(num + 1, sizeof(*list));
+    for (i = 0; i < num; i++) {
+        list[i] = config_setting_get_string_elem(setting, i);
+        if (!list[i]) {
+            fprintf(stderr, "%s: list of strings expected\n", name);
+            exit(1);
+        }
+    }
+    return list;
+}
+
+/* Sets up routing on server name and ALPN for a TLS protocol */
+static void setup_tls_match(struct proto *p, config_setting_t *prot)
+{
+    struct tls_match *match;
+    const char **sni, **alpn;
+
+    sni = config_string_list(prot, "sni-hostnames");
+    alpn = config_string_list(prot, "alpn-protocols");
+    if (!sni && !alpn)
+        return;
+
+    if (p->probe != get_probe("tls")) {
+        fprintf(stderr, "%s: sni-hostnames and alpn-protocols need the builtin tls probe\n", p->description);
+        exit(1);
+    }
+
+    match = calloc(1, sizeof(*match));
+    match->sni_hostnames = sni;
+    match->alpn_protocols = alpn;
+    p->data = match;
+}
+
+/* Sets up routing on host and path for an HTTP protocol */
+static void setup_http_match(struct proto *p, config_setting_t *prot)
+{
+    struct http_match *match;
+    const char **hosts, **paths;
+
+    hosts = config_string_list(prot, "http-hosts");
+    paths = config_string_list(prot, "path-prefixes");
+    if (!hosts && !paths)
+        return;
+
+    if (p->probe != get_probe("http")) {
+        fprintf(stderr, "%s: http-hosts and path-prefixes need the builtin http probe\n", p->description);
+        exit(1);
+    }
+
+    match = calloc(1, sizeof(*match));
+    match->hosts = hosts;
+    match->path_prefixes = paths;
+    p->data = match;
+}
+#endif
+
+/* Extract configuration for protocols to connect to.
+ * out: newly-allocated list of protocols
+ */
+#ifdef LIBCONFIG
+static int config_protocols(config_t *config, struct proto **prots)
+{
+    config_setting_t *setting, *prot, *probes;
+    const char *hostname, *port, *name;
+    int i, num_prots;
+    long int watermark, pool_size;
+    struct proto *p, *prev = NULL;
+
+    setting = config_lookup(config, "protocols");
+    if (setting) {
+        num_prots = config_setting_length(setting);
+        for (i = 0; i < num_prots; i++) {
+            p = calloc(1, sizeof(*p));
+            if (i == 0) *prots = p;
+            if (prev) prev->next = p;
+            prev = p;
+
+            prot = config_setting_get_elem(setting, i);
+            if ((config_setting_lookup_string(prot, "name", &name) &&
+                 config_setting_lookup_string(prot, "host", &hostname) &&
+                 config_setting_lookup_string(prot, "port", &port)
+                )) {
+                p->description = name;
+                config_setting_lookup_string(prot, "service", &(p->service));
+                if (config_setting_lookup_int(prot, "low-watermark", &watermark))
+                    p->low_watermark = watermark;
+                if (config_setting_lookup_int(prot, "high-watermark", &watermark))
+                    p->high_watermark = watermark;
+                if (config_setting_lookup_int(prot, "pool", &pool_size))
+                    p->pool_size = pool_size;
+
+                resolve_split_name(&(p->saddr), hostname, port);
+
+
+                probes = config_setting_get_member(prot, "probe");
+                if (probes) {
+                    if (config_setting_is_array(probes)) {
+                        /* If 'probe' is an array, setup a regex probe using the
+                         * array of strings as pattern */
+
+                        setup_regex_probe(p, probes);
+
+                    } else {
+                        /* if 'probe' is 'builtin', set the probe to the
+                         * appropriate builtin protocol */
+                        if (!strcmp(config_setting_get_string(probes), "builtin")) {
+                            p->probe = get_probe(name);
+                            if (!p->probe) {
+                                fprintf(stderr, "%s: no builtin probe for this protocol\n", name);
+                                exit(1);
+                            }
+                        } else if (!strncmp(config_setting_get_string(probes), "plugin:", 7)) {
+                            /* 'plugin:<path>': probe from a shared object */
+                            if (load_probe_plugin(p, config_setting_get_string(probes) + 7))
+                                exit(1);
+                        } else {
+                            fprintf(stderr, "%s: illegal probe name\n", name);
+                            exit(1);
+                        }
+                    }
+                }
+                setup_tls_match(p, prot);
+                setup_http_match(p, prot);
+            }
+        }
+    }
+
+    regex_set_build();
+
+    return 0;
+}
+#endif
+
+/* Parses a config file
+ * in: *filename
+ * out: *listen, a newly-allocated linked list of listen addrinfo
+ *      *prots, a newly-allocated linked list of protocols
+ */
+#ifdef LIBCONFIG
+static int config_parse(char *filename, struct addrinfo **listen, struct proto **prots)
+{
+    config_t config;
+    long int timeout, threads, backlog, batch, budget, limit, watermark, workers;
+    double ftimeout;
+    const char* str;
+
+    config_init(&config);
+    if (config_read_file(&config, filename) == CONFIG_FALSE) {
+        fprintf(stderr, "%s:%d:%s\n", 
+                    filename,
+                    config_error_line(&config),
+                    config_error_text(&config));
+        exit(1);
+    }
+
+    config_lookup_bool(&config, "verbose", &verbose);
+    config_lookup_bool(&config, "inetd", &inetd);
+    config_lookup_bool(&config, "foreground", &foreground);
+    config_lookup_bool(&config, "numeric", &numeric);
+    config_lookup_bool(&config, "splice", &use_splice);
+    config_lookup_bool(&config, "defer-accept", &defer_accept);
+    config_lookup_bool(&config, "prefork", &prefork);
+
+    if (config_lookup_int(&config, "timeout", &timeout) == CONFIG_TRUE) {
+        probing_timeout = timeout;
+    } else if (config_lookup_float(&config, "timeout", &ftimeout) == CONFIG_TRUE) {
+        probing_timeout = ftimeout;
+    }
+
+    if (config_lookup_int(&config, "threads", &threads) == CONFIG_TRUE) {
+        num_threads = threads;
+    }
+
+    if (config_lookup_int(&config, "backlog", &backlog) == CONFIG_TRUE) {
+        listen_backlog = backlog;
+    }
+
+    if (config_lookup_int(&config, "accept-batch", &batch) == CONFIG_TRUE) {
+        accept_batch = batch;
+    }
+
+    if (config_lookup_int(&config, "relay-budget", &budget) == CONFIG_TRUE) {
+        relay_budget = budget;
+    }
+
+    if (config_lookup_int(&config, "http-header-limit", &limit) == CONFIG_TRUE) {
+        http_header_limit = limit;
+    }
+
+    if (config_lookup_int(&config, "low-watermark", &watermark) == CONFIG_TRUE) {
+        low_watermark = watermark;
+    }
+
+    if (config_lookup_int(&config, "high-watermark", &watermark) == CONFIG_TRUE) {
+        high_watermark = watermark;
+    }
+
+    if (config_lookup_int(&config, "min-spare-workers", &workers) == CONFIG_TRUE) {
+        min_spare_workers = workers;
+    }
+
+    if (config_lookup_int(&config, "max-spare-workers", &workers) == CONFIG_TRUE) {
+        max_spare_workers = workers;
+    }
+
+    if (config_lookup_int(&config, "max-workers", &workers) == CONFIG_TRUE) {
+        max_workers = workers;
+    }
+
+    if (config_lookup_int(&config, "max-worker-connections", &workers) == CONFIG_TRUE) {
+        max_worker_connections = workers;
+    }
+
+    if (config_lookup_string(&config, "on-timeout", &str)) {
+        set_ontimeout(str);
+    }
+
+    config_lookup_string(&config, "user", &user_name);
+    config_lookup_string(&config, "pidfile", &pid_file);
+    config_lookup_string(&config, "mapsock", &map_sock_path);
+
+    config_listen(&config, listen);
+    config_protocols(&config, prots);
+
+    return 0;
+}
+#endif
+
+/* Adds protocols to the list of options, so command-line parsing uses the
+ * protocol definition array 
+ * options: array of options to add to; must be big enough
+ * n_opts: number of options in *options before calling (i.e. where to append)
+ * prot: array of protocols
+ * n_prots: number of protocols in *prot
+ * */
+static void append_protocols(struct option *options, int n_opts, struct proto *prot , int n_prots)
+{
+    int o, p;
+
+    for (o = n_opts, p = 0; p < n_prots; o++, p++) {
+        options[o].name = prot[p].description;
+        options[o].has_arg = required_argument;
+        options[o].flag = 0;
+        options[o].val = p + PROT_SHIFT;
+    }
+}
+
+static void make_alloptions(void)
+{
+    builtins = get_builtins();
+
+    /* Create all_options, composed of const_options followed by one option per
+     * known protocol */
+    all_options = calloc(ARRAY_SIZE(const_options) + get_num_builtins(), sizeof(struct option));
+    memcpy(all_options, const_options, sizeof(const_options));
+    append_protocols(all_options, ARRAY_SIZE(const_options) - 1, builtins, get_num_builtins());
+}
+
+/* Performs a first scan of command line options to see if a configuration file
+ * is specified. If there is one, parse it now before all other options (so
+ * configuration file settings can be overridden from the command line).
+ *
+ * prots: newly-allocated list of configured protocols, if any.
+ */
+static void cmdline_config(int argc, char* argv[], struct proto** prots)
+{
+#ifdef LIBCONFIG
+    int c, res;
+    char *config_filename;
+#endif
+
+    make_alloptions();
+
+#ifdef LIBCONFIG
+    optind = 1;
+    opterr = 0; /* we're missing protocol options at this stage so don't output errors */
+    while ((c = getopt_long_only(argc, argv, optstr, all_options, NULL)) != -1) {
+        if (c == 'F') {
+            config_filename = optarg;
+            /* find the end of the listen list */
+            res = config_parse(config_filename, &addr_listen, prots);
+            if (res)
+                exit(4);
+            break;
+        }
+    }
+#endif
+}
+
+
+/* Exits if the watermarks of protocol name (NULL for the global setting)
+ * don't make sense */
+static void check_watermarks(const char* name, int low, int high)
+{
+    if ((low < 0) || (low >= high)) {
+        fprintf(stderr, "%s%slow-watermark (%d) must be lower than high-watermark (%d).\n",
+                name ? name : "", name ? ": " : "", low, high);
+        exit(1);
+    }
+}
+
+/* Parse command-line options. prots points to a list of configured protocols,
+ * potentially non-allocated */
+static void parse_cmdline(int argc, char* argv[], struct proto* prots)
+{
+    int c;
+    struct addrinfo **a;
+    struct proto *p;
+
+    optind = 1;
+    opterr = 1;
+next_arg:
+    while ((c = getopt_long_only(argc, argv, optstr, all_options, NULL)) != -1) {
+        if (c == 0) continue;
+
+        if (c >= PROT_SHIFT) {
+            if (prots)
+                for (p = prots; p && p->next; p = p->next) {
+                    /* override if protocol was already defined by config file 
+                     * (note it only overrides address and use builtin probe).
+                     * The data of another probe (regex, plugin) means nothing
+                     * to the builtin one: only keep the data of an entry that
+                     * already used it (e.g. sni-hostnames for tls). */
+                    if (!strcmp(p->description, builtins[c-PROT_SHIFT].description)) {
+                        resolve_name(&(p->saddr), optarg);
+                        if (p->probe != builtins[c-PROT_SHIFT].probe)
+                            p->data = builtins[c-PROT_SHIFT].data;
+                        p->probe = builtins[c-PROT_SHIFT].probe;
+                        goto next_arg;
+                    }
+                }
+            /* At this stage, it's a new protocol: add it to the end of the
+             * list */
+            if (!prots) {
+                /* No protocols yet -- create the list */
+                p = prots = calloc(1, sizeof(*p));
+            } else {
+                p->next = calloc(1, sizeof(*p));
+                p = p->next;
+            }
+            memcpy(p, &builtins[c-PROT_SHIFT], sizeof(*p));
+            resolve_name(&(p->saddr), optarg);
+            continue;
+        }
+
+        switch (c) {
+
+        case 'F':
+            /* Legal option, but do nothing, it was already processed in
+             * cmdline_config() */
+#ifndef LIBCONFIG
+            fprintf(stderr, "Built without libconfig support: configuration file not available.\n");
+            exit(1);
+#endif
+            break;
+
+        case 't':
+             probing_timeout = atof(optarg);
+            break;
+
+        case OPT_ONTIMEOUT:
+            set_ontimeout(optarg);
+            break;
+
+        case OPT_THREADS:
+            num_threads = atoi(optarg);
+            break;
+
+        case OPT_BACKLOG:
+            listen_backlog = atoi(optarg);
+            break;
+
+        case OPT_ACCEPTBATCH:
+            accept_batch = atoi(optarg);
+            break;
+
+        case OPT_RELAYBUDGET:
+            relay_budget = atoi(optarg);
+            break;
+
+        case OPT_HTTPLIMIT:
+            http_header_limit = atoi(optarg);
+            break;
+
+        case OPT_LOWWATER:
+            low_watermark = atoi(optarg);
+            break;
+
+        case OPT_HIGHWATER:
+            high_watermark = atoi(optarg);
+            break;
+
+        case OPT_MINSPARE:
+            min_spare_workers = atoi(optarg);
+            break;
+
+        case OPT_MAXSPARE:
+            max_spare_workers = atoi(optarg);
+            break;
+
+        case OPT_MAXWORKERS:
+            max_workers = atoi(optarg);
+            break;
+
+        case OPT_WORKERCNX:
+            max_worker_connections = atoi(optarg);
+            break;
+
+        case 'p':
+            /* find the end of the listen list */
+            for (a = &addr_listen; *a; a = &((*a)->ai_next));
+            /* append the specified addresses */
+            resolve_name(a, optarg);
+            
+            break;
+
+        case 'V':
+            printf("%s %s\n", server_type, VERSION);
+            exit(0);
+
+        case 'u':
+            user_name = optarg;
+            break;
+
+        case 'P':
+            pid_file = optarg;
+            break;
+
+        case 'm':
+            map_sock_path = optarg;
+            break;
+
+        case 'v':
+            verbose++;
+            break;
+
+        default:
+            print_usage();
+            exit(2);
+        }
+    }
+
+    if (!prots) {
+        fprintf(stderr, "At least one target protocol must be specified.\n");
+        exit(2);
+    }
+
+    set_protocol_list(prots);
+
+    if (num_threads < 1) {
+        fprintf(stderr, "Number of threads must be at least 1.\n");
+        exit(1);
+    }
+
+    if (accept_batch < 1) {
+        fprintf(stderr, "accept-batch must be at least 1.\n");
+        exit(1);
+    }
+
+    if (relay_budget < 1) {
+        fprintf(stderr, "relay-budget must be at least 1.\n");
+        exit(1);
+    }
+
+    if ((http_header_limit < 1) || (http_header_limit > MAX_PROBE_SIZE)) {
+        fprintf(stderr, "http-header-limit must be between 1 and %d.\n", MAX_PROBE_SIZE);
+        exit(1);
+    }
+
+    check_watermarks(NULL, low_watermark, high_watermark);
+    if ((min_spare_workers < 1) || (max_spare_workers < min_spare_workers) ||
+        (max_workers < min_spare_workers) || (max_worker_connections < 0)) {
+        fprintf(stderr, "Need 1 <= min-spare-workers <= max-spare-workers, min-spare-workers <= max-workers, and max-worker-connections >= 0.\n");
+        exit(1);
+    }
+    for (p = prots; p; p = p->next) {
+        check_watermarks(p->description, 
+                         p->low_watermark ? p->low_watermark : low_watermark,
+                         p->high_watermark ? p->high_watermark : high_watermark);
+        if (p->pool_size < 0) {
+            fprintf(stderr, "%s: pool size must be positive.\n", p->description);
+            exit(1);
+        }
+    }
+
+    /* Did command-line override foreground setting? */
+    if (background)
+        foreground = 0;
+
+}
+
+/* Reads the configuration file and the command line, and sets up the list of
+ * protocols (see set_protocol_list()). Exits if they're wrong. */
+void read_config(int argc, char *argv[])
+{
+   struct proto* protocols = NULL;
+
+   cmdline_config(argc, argv, &protocols);
+   parse_cmdline(argc, argv, protocols);
+}
@@ -24,52 +24,113 @@
 #include "probe.h"
 #include "ip-map.h"
 
-const char* server_type = "sslh-fork";
+#include <poll.h>
+#include <sys/mman.h>
 
-#define MAX(a, b)  (((a) > (b)) ? (a) : (b))
+const char* server_type = "sslh-fork";
 
-/* shovels data from one fd to the other and vice-versa 
-   returns after one socket closed
- */
+/* Relays data both ways until one side closes (returns FD_CNXCLOSED) or an
+ * error occurs (returns -1). Sockets are made non-blocking: whatever can't be
+ * written straight away stays in the queue (defered buffer, or pipe with
+ * --splice) and goes out when poll() says the socket can take more. In the
+ * meantime, the other side is read from until the queue reaches the high
+ * watermark, then only once it is down to the low watermark. poll() works
+ * whatever the file descriptor numbers, unlike select().
+ * Once a side reaches end of file, it is no longer polled, and the other side
+ * is only written to until its queue is empty; it is then shut down for
+ * writing. */
 int shovel(struct connection *cnx)
 {
-   fd_set fds;
-   int res, i;
-   int max_fd = MAX(cnx->q[0].fd, cnx->q[1].fd) + 1;
+   struct pollfd pfd[2];
+   struct queue *q;
+   int res, i, closing;
+
+   for (i = 0; i < 2; i++)
+      set_nonblock(cnx->q[i].fd);
 
-   FD_ZERO(&fds);
    while (1) {
-      FD_SET(cnx->q[0].fd, &fds);
-      FD_SET(cnx->q[1].fd, &fds);
-
-      res = select(
-                   max_fd,
-                   &fds,
-                   NULL,
-                   NULL,
-                   NULL
-                  );
-      CHECK_RES_DIE(res, "select");
+      for (i = 0; i < 2; i++) {
+         q = &cnx->q[i];
+         if (queue_full(q, cnx->high_watermark))
+            q->full = 1;
+         else if (queue_size(q) <= cnx->low_watermark)
+            q->full = 0;
+      }
+
+      closing = cnx->q[0].eof || cnx->q[1].eof;
+      for (i = 0; i < 2; i++) {
+         /* poll() ignores negative file descriptors */
+         pfd[i].fd = cnx->q[i].eof ? -1 : cnx->q[i].fd;
+         pfd[i].events = 0;
+         if (!closing && !cnx->q[1-i].full)
+            pfd[i].events |= POLLIN;
+         if (queue_pending(&cnx->q[i]))
+            pfd[i].events |= POLLOUT;
+      }
+
+      res = poll(pfd, 2, -1);
+      if (res == -1) {
+         if (errno == EINTR)
+            continue;
+         log_message(LOG_ERR, "poll: %s\n", strerror(errno));
+         return -1;
+      }
 
       for (i = 0; i < 2; i++) {
-          if (FD_ISSET(cnx->q[i].fd, &fds)) {
-              res = fd2fd(&cnx->q[1-i], &cnx->q[i]);
-              if (!res) {
-                  if (verbose) 
-                      fprintf(stderr, "%s %s", i ? "client" : "server", "socket closed\n");
-                  return res;
-              }
-          }
+         q = &cnx->q[i];
+
+         /* Error or hang-up on a socket that is not being read: the other
+          * side will never get more data */
+         if ((pfd[i].revents & (POLLERR | POLLHUP)) &&
+             !(pfd[i].revents & (POLLIN | POLLOUT)))
+            return FD_CNXCLOSED;
+
+         if ((pfd[i].revents & POLLOUT) && queue_pending(q)) {
+            res = flush_defered(q);
+            if ((res == -1) && (errno != EAGAIN) && (errno != EINTR))
+               return FD_CNXCLOSED;
+            if (!queue_pending(q) && cnx->q[1-i].eof) {
+               shutdown(q->fd, SHUT_WR);
+               return FD_CNXCLOSED;
+            }
+         }
+
+         if (!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) || closing ||
+             cnx->q[1-i].full)
+            continue;
+
+         /* Read until there is nothing left, or the other side is full */
+         do {
+            res = fd2fd(&cnx->q[1-i], q);
+         } while ((res > 0) ||
+                  ((res == FD_STALLED) && !q->eof &&
+                   !queue_full(&cnx->q[1-i], cnx->high_watermark)));
+
+         if (res == -1)
+            return res;
+
+         if (q->eof) {
+            if (verbose) 
+               fprintf(stderr, "%s %s", i ? "server" : "client", "socket closed\n");
+            if (res == FD_CNXCLOSED) {
+               shutdown(cnx->q[1-i].fd, SHUT_WR);
+               return res;
+            }
+            /* What it sent still has to go out */
+            closing = 1;
+         }
       }
    }
 }
 
-/* Child process that finds out what to connect to and proxies 
- */
-void start_shoveler(int in_socket)
+/* Finds out what to connect the client to, and proxies until one side
+ * closes. Closes in_socket before returning. listener is the index of the
+ * listening address it came from, -1 if the probes don't need to know (see
+ * probe_buffer()). */
+static void serve_connection(int in_socket, int listener)
 {
-   fd_set fds;
-   struct timeval tv;
+   struct pollfd pfd;
+   long long deadline, wait;
    struct addrinfo *saddr;
    int res;
    int out_socket;
@@ -78,33 +139,45 @@ void start_shoveler(int in_socket)
 
    init_cnx(&cnx);
 
-   FD_ZERO(&fds);
-   FD_SET(in_socket, &fds);
-   memset(&tv, 0, sizeof(tv));
-   tv.tv_sec = probing_timeout;
-   res = select(in_socket + 1, &fds, NULL, NULL, &tv);
-   if (res == -1)
-      perror("select");
-
    cnx.q[0].fd = in_socket;
-
-   if (FD_ISSET(in_socket, &fds)) {
-       /* Received data: figure out what protocol it is */
-       prot = probe_client_protocol(&cnx);
-   } else {
-       /* Timed out: it's necessarily SSH */
-       prot = timeout_protocol();
+   cnx.listener = listener;
+
+   /* Probe what the client sends until the probes can tell, or until the
+    * timeout; the kernel already waited for it with --defer-accept */
+   deadline = monotonic_ms() + (long long)(probing_timeout * 1000);
+   prot = silent_client(in_socket) ? timeout_protocol() : NULL;
+   while (!prot) {
+       pfd.fd = in_socket;
+       pfd.events = POLLIN;
+       wait = deadline - monotonic_ms();
+       res = (wait > 0) ? poll(&pfd, 1, wait) : 0;
+       if ((res == -1) && (errno != EINTR))
+          perror("poll");
+
+       if (res > 0)
+           prot = probe_client_protocol(&cnx);
+       else if ((res == 0) || (errno != EINTR))
+           prot = probe_timed_out(&cnx);
    }
 
+   cnx.low_watermark = prot->low_watermark ? prot->low_watermark : low_watermark;
+   cnx.high_watermark = prot->high_watermark ? prot->high_watermark : high_watermark;
+
    saddr = prot->saddr;
    if (prot->service && 
        check_access_rights(in_socket, prot->service)) {
-       exit(0);
+       /* check_access_rights() closed the socket already */
+       release_queue(&cnx.q[1]);
+       return;
    }
 
    /* Connect the target socket */
    out_socket = connect_addr(saddr, prot->description);
-   CHECK_RES_DIE(out_socket, "connect");
+   if (out_socket == -1) {
+       close(in_socket);
+       release_queue(&cnx.q[1]);
+       return;
+   }
 
    cnx.q[1].fd = out_socket;
 
@@ -120,10 +193,19 @@ void start_shoveler(int in_socket)
 
    close(in_socket);
    close(out_socket);
+   release_queue(&cnx.q[0]);
+   release_queue(&cnx.q[1]);
    
    if (verbose)
       fprintf(stderr, "connection closed down\n");
+}
 
+/* Child process that finds out what to connect to and proxies 
+ */
+void start_shoveler(int in_socket)
+{
+   /* Only one connection in this process: no use counting probe hits */
+   serve_connection(in_socket, -1);
    exit(0);
 }
 
@@ -135,17 +217,279 @@ void stop_listeners(int sig)
     int i;
 
     for (i = 0; i < listener_pid_number; i++) {
-        kill(listener_pid[i], sig);
+        if (listener_pid[i] > 0)
+            kill(listener_pid[i], sig);
+    }
+}
+
+/* Starts the process that accepts connections on the IP map socket.
+ * Returns its PID */
+static int start_map_listener(int map_socket)
+{
+    int in_socket, res, pid;
+
+    if (!(pid = fork())) {
+        while (1)
+        {
+            in_socket = accept(map_socket, 0, 0);
+            if (verbose) fprintf(stderr, "accepted fd %d\n", in_socket);
+
+            if (!fork())
+            {
+                close(map_socket);
+                struct map_queue map_q = new_map_queue(in_socket);
+                while(1)
+                {
+                   res = handle_connection(&map_q);
+                   if (!res)
+                       exit(0);
+                }
+                exit(0);
+            }
+            close(in_socket);
+        }
+    }
+    close(map_socket);
+    return pid;
+}
+
+/* Prefork mode (--prefork): instead of forking a process for each
+ * connection, worker processes wait for connections on all the listening
+ * sockets and serve them one after the other. The head process keeps between
+ * min_spare_workers and max_spare_workers of them idle, up to max_workers in
+ * total, as Apache's prefork does. A worker exits after serving
+ * max_worker_connections connections, and gets replaced if needed.
+ *
+ * Workers tell what they are doing in the scoreboard, which is shared with
+ * the head process. */
+enum worker_state {
+    WORKER_FREE = 0,    /* slot not in use */
+    WORKER_IDLE,        /* waiting for a connection */
+    WORKER_BUSY,        /* serving a connection */
+    WORKER_STOPPING     /* told to exit */
+};
+
+struct worker_slot {
+    int pid;
+    volatile int state;
+};
+
+static struct worker_slot *scoreboard;
+static volatile sig_atomic_t stop_requested, stats_requested;
+
+static void request_stop(int sig)
+{
+    stop_requested = 1;
+}
+
+/* SIGUSR1: workers log their probe counters (see log_probe_stats()), the head
+ * process passes the signal on to them */
+static void request_stats(int sig)
+{
+    stats_requested = 1;
+}
+
+/* Only there to interrupt sleep() */
+static void wake_up(int sig)
+{
+}
+
+static int count_idle_workers(void)
+{
+    int i, n = 0;
+
+    for (i = 0; i < max_workers; i++)
+        if (scoreboard[i].state == WORKER_IDLE)
+            n++;
+    return n;
+}
+
+/* Worker process: serves connections from all the listening sockets, one at
+ * a time, until it served max_worker_connections of them or it is told to
+ * stop. SIGTERM and SIGUSR1 are only let through while waiting for a
+ * connection, so a worker finishes the connection it is serving before
+ * exiting or logging its probe counters. */
+static void worker_loop(int slot, int listen_sockets[], int num_listen)
+{
+    struct pollfd *pfds;
+    struct sigaction action;
+    sigset_t mask, wait_mask;
+    int i, res, in_socket, served = 0;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = request_stats;
+    sigaction(SIGUSR1, &action, NULL);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &mask, &wait_mask);
+    sigdelset(&wait_mask, SIGTERM);
+    sigdelset(&wait_mask, SIGUSR1);
+
+    pfds = malloc(num_listen * sizeof(*pfds));
+    if (!pfds)
+        exit(1);
+    for (i = 0; i < num_listen; i++) {
+        pfds[i].fd = listen_sockets[i];
+        pfds[i].events = POLLIN;
+    }
+
+    while (!stop_requested &&
+           (!max_worker_connections || (served < max_worker_connections))) {
+        scoreboard[slot].state = WORKER_IDLE;
+        res = ppoll(pfds, num_listen, NULL, &wait_mask);
+        if (stats_requested) {
+            stats_requested = 0;
+            log_probe_stats();
+        }
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            log_message(LOG_ERR, "poll: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        for (i = 0; i < num_listen; i++) {
+            if (!(pfds[i].revents & POLLIN))
+                continue;
+
+            /* Other workers were woken up too: whoever loses the race gets
+             * EAGAIN (listening sockets are non-blocking) */
+            in_socket = accept(listen_sockets[i], 0, 0);
+            if (in_socket == -1)
+                continue;
+
+            scoreboard[slot].state = WORKER_BUSY;
+            if (count_idle_workers() < min_spare_workers)
+                kill(getppid(), SIGUSR2);
+
+            if (verbose) fprintf(stderr, "accepted fd %d\n", in_socket);
+            serve_connection(in_socket, i);
+            served++;
+            break;
+        }
+    }
+    exit(0);
+}
+
+/* Starts a worker in a free slot of the scoreboard. Returns -1 if there is
+ * none, or if fork() failed */
+static int start_worker(int listen_sockets[], int num_listen)
+{
+    int slot, pid;
+
+    for (slot = 0; (slot < max_workers) && (scoreboard[slot].state != WORKER_FREE); slot++);
+    if (slot == max_workers)
+        return -1;
+
+    scoreboard[slot].state = WORKER_IDLE;
+    pid = fork();
+    if (pid == -1) {
+        log_message(LOG_ERR, "fork: %s\n", strerror(errno));
+        scoreboard[slot].state = WORKER_FREE;
+        return -1;
+    }
+    if (!pid)
+        worker_loop(slot, listen_sockets, num_listen);
+
+    scoreboard[slot].pid = pid;
+    return 0;
+}
+
+/* Tells an idle worker to exit */
+static void stop_worker(void)
+{
+    int slot;
+
+    for (slot = max_workers - 1; slot >= 0; slot--) {
+        if (scoreboard[slot].state == WORKER_IDLE) {
+            scoreboard[slot].state = WORKER_STOPPING;
+            kill(scoreboard[slot].pid, SIGTERM);
+            return;
+        }
     }
 }
 
+/* Head process of prefork mode: replaces workers that exited and keeps the
+ * number of idle workers within limits. It checks every second, and as soon
+ * as a worker exits or a worker takes a connection while there are too few
+ * idle ones left (SIGUSR2). It passes SIGUSR1 on to the workers. */
+static void prefork_loop(int listen_sockets[], int num_listen)
+{
+    struct sigaction action;
+    int i, pid, idle;
+
+    scoreboard = mmap(NULL, max_workers * sizeof(*scoreboard),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (scoreboard == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    for (i = 0; i < num_listen; i++)
+        fcntl(listen_sockets[i], F_SETFL, fcntl(listen_sockets[i], F_GETFL) | O_NONBLOCK);
+
+    /* Workers are reaped here (children were not to be waited for so far) */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = wake_up;
+    sigaction(SIGCHLD, &action, NULL);
+    sigaction(SIGUSR2, &action, NULL);
+    action.sa_handler = request_stop;
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = request_stats;
+    sigaction(SIGUSR1, &action, NULL);
+
+    while (!stop_requested) {
+        if (stats_requested) {
+            stats_requested = 0;
+            for (i = 0; i < max_workers; i++)
+                if (scoreboard[i].pid > 0)
+                    kill(scoreboard[i].pid, SIGUSR1);
+        }
+
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            for (i = 0; i < max_workers; i++) {
+                if (scoreboard[i].pid == pid) {
+                    scoreboard[i].pid = 0;
+                    scoreboard[i].state = WORKER_FREE;
+                }
+            }
+        }
+
+        idle = count_idle_workers();
+        for (; idle < min_spare_workers; idle++)
+            if (start_worker(listen_sockets, num_listen) == -1)
+                break;
+        if (idle > max_spare_workers)
+            stop_worker();
+
+        sleep(1);
+    }
+
+    /* Busy workers finish their connection first */
+    for (i = 0; i < max_workers; i++)
+        if (scoreboard[i].state != WORKER_FREE)
+            kill(scoreboard[i].pid, SIGTERM);
+}
+
 void main_loop(int listen_sockets[], int num_addr_listen, int *map_socket)
 {
     int in_socket, i, res;
     struct sigaction action;
 
     listener_pid_number = num_addr_listen+1;
-    listener_pid = malloc(listener_pid_number * sizeof(listener_pid[0]));
+    listener_pid = calloc(listener_pid_number, sizeof(listener_pid[0]));
+
+    if (map_socket)
+        listener_pid[num_addr_listen] = start_map_listener(*map_socket);
+
+    if (prefork) {
+        prefork_loop(listen_sockets, num_addr_listen);
+        stop_listeners(SIGTERM);
+        return;
+    }
 
     /* Start one process for each listening address */
     for (i = 0; i < num_addr_listen; i++) {
@@ -170,31 +514,6 @@ void main_loop(int listen_sockets[], int num_addr_listen, int *map_socket)
         close(listen_sockets[i]);
     }
 
-    if (map_socket) {
-        if (!(listener_pid[num_addr_listen] = fork())) {
-            while (1)
-            {
-                in_socket = accept(*map_socket, 0, 0);
-                if (verbose) fprintf(stderr, "accepted fd %d\n", in_socket);
-
-                if (!fork())
-                {
-                    close(*map_socket);
-                    struct map_queue map_q = new_map_queue(in_socket);
-                    while(1)
-                    {
-                       res = handle_connection(&map_q);
-                       if (!res)
-                           exit(0);
-                    }
-                    exit(0);
-                }
-                close(in_socket);
-            }
-        }
-        close(*map_socket);
-    }
-
     /* Set SIGTERM to "stop_listeners" which further kills all listener
      * processes. Note this won't kill processes that listeners forked, which
      * means active connections remain active. */
@@ -24,128 +24,541 @@
 
 #include "common.h"
 #include "probe.h"
+#include "slab.h"
+
+#include <sys/epoll.h>
+#include <stdint.h>
 
 const char* server_type = "sslh-select";
 
-/* cnx_num_alloc is the number of connection to allocate at once (at start-up,
- * and then every time we get too many simultaneous connections: e.g. start
- * with 100 slots, then if we get more than 100 connections allocate another
- * 100 slots, and so on). We never free up connection structures. We try to
- * allocate as many structures at once as will fit in one page (which is 102
- * in sslh 1.9 on Linux on x86)
- */
-static long cnx_num_alloc;
+/* Maximum number of events processed for each call to epoll_wait() */
+#define MAX_EVENTS      256
+
+/* epoll user data: pointer to the connection, with the index of the queue
+ * the event is for in the low bit (connections are at least 8-byte aligned).
+ * Connection attempts to a server are tagged with EV_CONNECT until one of
+ * them wins. Listening sockets are tagged with EV_LISTEN and carry their index
+ * in listen_sockets[] above the tag bits (entries of listen_sockets[] are not
+ * aligned enough to be tagged). */
+#define EV_QUEUE_MASK   1
+#define EV_LISTEN       2
+#define EV_CONNECT      4   /* connection attempt to the server */
+#define EV_TAG_MASK     7
+
+#define EV_DATA(ptr, tag)   ((uint64_t)(uintptr_t)(ptr) | (tag))
+#define EV_PTR(data)        ((void*)(uintptr_t)((data) & ~(uint64_t)EV_TAG_MASK))
+
+#define EV_LISTEN_DATA(i)   (((uint64_t)(i) << 3) | EV_LISTEN)
+#define EV_LISTEN_INDEX(data)   ((int)((data) >> 3))
+
+static __thread int epoll_fd;
+
+/* Connection structures come from a slab pool: allocating and releasing them
+ * is O(1), they never move (the kernel keeps pointers to them in the epoll
+ * set), and slabs that empty out after a burst of connections are given back
+ * to the system. */
+static __thread struct slab_pool cnx_pool;
+
+/* Lists of connections ordered by deadline: connections being probed (all
+ * get the same probing timeout), and connections waiting to start their next
+ * connection attempt to the server (usually CONNECT_ATTEMPT_DELAY after the
+ * previous one, sooner if an attempt failed early). A new deadline is
+ * inserted in order, looking from the tail: as most deadlines of a list are
+ * the same delay away from when they are set, that is nearly always
+ * appending, so arming and cancelling a timer is O(1) in practice, and
+ * expired connections are all at the head of the list. A connection is in at
+ * most one list, depending on its state. */
+struct timer_list {
+    struct connection *head, *tail;
+};
+
+static __thread struct timer_list probing, connecting;
+
+/* Connections established in advance to the server of a protocol that has a
+ * 'pool' setting: once a client is probed, it takes one of them instead of
+ * waiting for a new connection to the server. Pooled connections are in the
+ * ready list, oldest first; their deadline is when they joined it. Each
+ * worker has its own pools. */
+struct backend_pool {
+    struct proto *prot;
+    struct timer_list ready;
+    int num_ready, num_connecting;
+    long long retry_at;     /* don't start new connections before that */
+    struct backend_pool *next;
+};
+
+static __thread struct backend_pool *pools;
+
+/* Delay before replacing pooled connections that failed or got closed, so a
+ * server that refuses or drops connections isn't hammered (ms) */
+#define POOL_RETRY_DELAY    1000
 
-/* Make the file descriptor non-block  */
-int set_nonblock(int fd)
+/* Sets the deadline of the connection to delay ms from now */
+static void timer_arm(struct timer_list *l, struct connection *cnx, long long delay)
 {
-    int flags;
+    struct connection *prev;
+
+    cnx->deadline = monotonic_ms() + delay;
+    for (prev = l->tail; prev && (prev->deadline > cnx->deadline); prev = prev->timer_prev);
+
+    cnx->timer_prev = prev;
+    cnx->timer_next = prev ? prev->timer_next : l->head;
+    if (prev)
+        prev->timer_next = cnx;
+    else
+        l->head = cnx;
+    if (cnx->timer_next)
+        cnx->timer_next->timer_prev = cnx;
+    else
+        l->tail = cnx;
+}
 
-    flags = fcntl(fd, F_GETFL);
-    CHECK_RES_RETURN(flags, "fcntl");
+/* Removes the connection from the list, if it is in it */
+static void timer_cancel(struct timer_list *l, struct connection *cnx)
+{
+    if (!cnx->timer_prev && (l->head != cnx))
+        return;
+
+    if (cnx->timer_prev)
+        cnx->timer_prev->timer_next = cnx->timer_next;
+    else
+        l->head = cnx->timer_next;
+    if (cnx->timer_next)
+        cnx->timer_next->timer_prev = cnx->timer_prev;
+    else
+        l->tail = cnx->timer_prev;
+    cnx->timer_prev = cnx->timer_next = NULL;
+}
+
+/* Returns 1 if the pool holds fewer connections than it should */
+static int pool_missing(struct backend_pool *pool)
+{
+    return pool->num_ready + pool->num_connecting < pool->prot->pool_size;
+}
 
-    flags |= O_NONBLOCK;
+/* Returns how long epoll_wait() may sleep before the next deadline of the
+ * lists (or before a pool is due to be refilled), in milliseconds (-1 if
+ * there is none) */
+static int timer_wait(void)
+{
+    long long next = -1, wait;
+    struct backend_pool *pool;
+
+    if (probing.head)
+        next = probing.head->deadline;
+    if (connecting.head && ((next == -1) || (connecting.head->deadline < next)))
+        next = connecting.head->deadline;
+    for (pool = pools; pool; pool = pool->next)
+        if (pool_missing(pool) && ((next == -1) || (pool->retry_at < next)))
+            next = pool->retry_at;
+
+    if (next == -1)
+        return -1;
 
-    flags = fcntl(fd, F_SETFL, flags);
-    CHECK_RES_RETURN(flags, "fcntl");
+    wait = next - monotonic_ms();
+    return wait > 0 ? wait : 0;
+}
 
-    return flags;
+/* Registers (op == EPOLL_CTL_ADD) or updates (op == EPOLL_CTL_MOD) the events
+ * monitored on queue j of the connection */
+static int watch_queue(struct connection *cnx, int j, int op, uint32_t events)
+{
+    struct epoll_event ev;
+    int res;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = EV_DATA(cnx, j);
+    res = epoll_ctl(epoll_fd, op, cnx->q[j].fd, &ev);
+    CHECK_RES_RETURN(res, "epoll_ctl");
+    return res;
 }
 
-int tidy_connection(struct connection *cnx, fd_set *fds, fd_set *fds2)
+/* Sets the events to monitor on both sides of a shoveling connection: a file
+ * descriptor is read from unless its pair is full (its defered data reached
+ * the high watermark, and hasn't gone down to the low watermark yet), and
+ * monitored for write while it has defered data of its own. Once one side
+ * reached end of file, it is no longer monitored (see close_when_flushed())
+ * and the other one is only written to. */
+static void update_watches(struct connection *cnx)
+{
+    int j, closing = cnx->q[0].eof || cnx->q[1].eof;
+    uint32_t events;
+    struct queue *q;
+
+    for (j = 0; j < 2; j++) {
+        q = &cnx->q[j];
+        if (queue_full(q, cnx->high_watermark))
+            q->full = 1;
+        else if (queue_size(q) <= cnx->low_watermark)
+            q->full = 0;
+    }
+
+    for (j = 0; j < 2; j++) {
+        if (cnx->q[j].eof)
+            continue;
+        events = 0;
+        if (!closing && !cnx->q[1-j].full)
+            events |= EPOLLIN;
+        if (queue_pending(&cnx->q[j]))
+            events |= EPOLLOUT;
+        watch_queue(cnx, j, EPOLL_CTL_MOD, events);
+    }
+}
+
+/* Takes a connection out of its backend pool */
+static void pool_remove(struct connection *cnx)
+{
+    struct backend_pool *pool = cnx->pool;
+
+    if (cnx->state == ST_POOLED) {
+        timer_cancel(&pool->ready, cnx);
+        pool->num_ready--;
+    } else {
+        pool->num_connecting--;
+    }
+    cnx->pool = NULL;
+}
+
+/* Closes both sides of the connection, releases the defered buffers and
+ * gives the connection structure back to the pool. Closing a file descriptor
+ * removes it from the epoll set. The structure remains readable (with both
+ * file descriptors set to -1) until the end of the current turn of the event
+ * loop, so events already returned for it can be recognised and skipped. */
+int tidy_connection(struct connection *cnx)
 {
     int i;
 
+    if (cnx->pool) {
+        /* Lost a pooled connection: it gets replaced later */
+        cnx->pool->retry_at = monotonic_ms() + POOL_RETRY_DELAY;
+        pool_remove(cnx);
+    }
+    if (cnx->state == ST_PROBING)
+        timer_cancel(&probing, cnx);
+    if (cnx->state == ST_CONNECTING) {
+        timer_cancel(&connecting, cnx);
+        connect_abort(&cnx->connect);
+    }
+
     for (i = 0; i < 2; i++) {
         if (cnx->q[i].fd != -1) {
             if (verbose)
                 fprintf(stderr, "closing fd %d\n", cnx->q[i].fd);
 
             close(cnx->q[i].fd);
-            FD_CLR(cnx->q[i].fd, fds);
-            FD_CLR(cnx->q[i].fd, fds2);
-            if (cnx->q[i].defered_data)
-                free(cnx->q[i].defered_data);
         }
+        /* Even without a file descriptor (e.g. the server never answered),
+         * the queue may hold data */
+        release_queue(&cnx->q[i]);
     }
     init_cnx(cnx);
+    slab_free(&cnx_pool, cnx);
     return 0;
 }
 
-/* Accepts a connection from the main socket and assigns it to an empty slot.
- * If no slots are available, allocate another few. If that fails, drop the
- * connexion */
-int accept_new_connection(int listen_socket, struct connection *cnx[], int* cnx_size) 
+void connect_probed(struct connection *cnx, int timed_out);
+
+/* Allocates a connection structure for a newly accepted (non-blocking)
+ * socket and starts probing it. If that fails, drop the connexion */
+static int new_connection(int in_socket, int listener)
 {
-    int in_socket, free, i, res;
-    struct connection *new;
+    int res;
+    struct connection *cnx;
 
-    in_socket = accept(listen_socket, 0, 0);
-    CHECK_RES_RETURN(in_socket, "accept");
+    cnx = slab_alloc(&cnx_pool);
+    if (!cnx) {
+        log_message(LOG_ERR, "unable to allocate connection -- dropping connection\n");
+        close(in_socket);
+        return -1;
+    }
+    init_cnx(cnx);
+    cnx->q[0].fd = in_socket;
+    cnx->listener = listener;
+    cnx->state = ST_PROBING;
+    timer_arm(&probing, cnx, (long long)(probing_timeout * 1000));
+
+    res = watch_queue(cnx, 0, EPOLL_CTL_ADD, EPOLLIN);
+    if (res == -1) {
+        tidy_connection(cnx);
+        return -1;
+    }
 
-    res = set_nonblock(in_socket);
-    if (res == -1) return -1;
+    if (verbose) 
+        fprintf(stderr, "accepted fd %d\n", in_socket);
 
-    /* Find an empty slot */
-    for (free = 0; (free < *cnx_size) && ((*cnx)[free].q[0].fd != -1); free++) {
-        /* nothing */
-    }
-    if (free >= *cnx_size)  {
-        if (verbose)
-            fprintf(stderr, "buying more slots from the slot machine.\n");
-        new = realloc(*cnx, (*cnx_size + cnx_num_alloc) * sizeof((*cnx)[0]));
-        if (!new) {
-            log_message(LOG_ERR, "unable to realloc -- dropping connection\n");
-            return -1;
+    /* With --defer-accept, the connection only got here once the client
+     * sent something, or once the kernel gave up waiting: no need to wait
+     * for an event or for the timeout */
+    if (defer_accept)
+        connect_probed(cnx, silent_client(in_socket));
+
+    return in_socket;
+}
+
+/* Accepts the connections waiting on a listening socket (of index listener),
+ * up to accept_batch of them: whatever is left is taken at the next turn of
+ * the event loop, so a flood of new connections cannot starve the
+ * established ones.
+ * Returns the number of connections accepted */
+int accept_new_connections(int listen_socket, int listener) 
+{
+    int in_socket, n;
+
+    for (n = 0; n < accept_batch; n++) {
+        in_socket = accept4(listen_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (in_socket == -1) {
+            switch (errno) {
+            case EAGAIN:
+                return n;
+
+            case EINTR:
+            case ECONNABORTED:
+                /* Client gave up while in the queue: carry on */
+                continue;
+
+            default:
+                /* e.g. out of file descriptors: leave the others waiting */
+                log_message(LOG_ERR, "accept: %s\n", strerror(errno));
+                return n;
+            }
         }
-        *cnx = new;
-        *cnx_size += cnx_num_alloc;
-        for (i = free; i < *cnx_size; i++) {
-            init_cnx(&(*cnx)[i]); 
+        new_connection(in_socket, listener);
+    }
+    return n;
+}
+
+
+/* Starts the connection attempts to the server that are due, and arms the
+ * timer for the next one. Closes the connection if all attempts failed. */
+static void connect_attempts(struct connection *cnx)
+{
+    struct epoll_event ev;
+    int fd, wait;
+
+    timer_cancel(&connecting, cnx);
+    while ((fd = connect_next(&cnx->connect)) != -1) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLOUT;
+        ev.data.u64 = EV_DATA(cnx, EV_CONNECT | 1);
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            log_message(LOG_CRIT, "epoll_ctl: %d\n", errno);
+            tidy_connection(cnx);
+            return;
         }
     }
-    (*cnx)[free].q[0].fd = in_socket;
-    (*cnx)[free].state = ST_PROBING;
-    (*cnx)[free].probe_timeout = time(NULL) + probing_timeout;
 
-    if (verbose) 
-        fprintf(stderr, "accepted fd %d on slot %d\n", in_socket, free);
+    if (connect_failed(&cnx->connect)) {
+        tidy_connection(cnx);
+        return;
+    }
 
-    return in_socket;
+    wait = connect_wait(&cnx->connect);
+    if (wait != -1)
+        timer_arm(&connecting, cnx, wait);
 }
 
+/* Connects queue 1 of the connection to the server at addr. The connection
+ * goes in ST_CONNECTING state: the client isn't read from until the server
+ * accepts the connection, and the data already read from the client waits in
+ * the defered buffer of queue 1. */
+static void connect_queue(struct connection *cnx, struct addrinfo *addr,
+                          const char* cnx_name)
+{
+    cnx->state = ST_CONNECTING;
+    if (watch_queue(cnx, 0, EPOLL_CTL_MOD, 0) == -1) {
+        tidy_connection(cnx);
+        return;
+    }
+    connect_init(&cnx->connect, addr, cnx_name);
+    connect_attempts(cnx);
+}
 
-/* Connect queue 1 of connection to SSL; returns new file descriptor */
-int connect_queue(struct connection *cnx, struct addrinfo *addr, 
-                  const char* cnx_name,
-                  fd_set *fds_r, fd_set *fds_w)
+/* The connection to the server is established: send it what the client
+ * sent so far, and relay both ways */
+static void start_shoveling(struct connection *cnx)
+{
+    cnx->state = ST_SHOVELING;
+    log_connection(cnx);
+    flush_defered(&cnx->q[1]);
+    update_watches(cnx);
+}
+
+/* A connection to the server of a pool is established: it waits in the pool
+ * for a client. Only hang-ups and errors are monitored (some servers speak
+ * first, and that data must stay where it is until there is a client). */
+static void pool_add(struct connection *cnx)
+{
+    struct backend_pool *pool = cnx->pool;
+
+    cnx->state = ST_POOLED;
+    pool->num_connecting--;
+    pool->num_ready++;
+    timer_arm(&pool->ready, cnx, 0);
+    if (watch_queue(cnx, 1, EPOLL_CTL_MOD, EPOLLRDHUP) == -1)
+        tidy_connection(cnx);
+}
+
+/* An attempt to connect to the server finished (one of the sockets became
+ * writable): start shoveling if it succeeded, otherwise start the next
+ * attempt */
+static void connect_done(struct connection *cnx)
 {
     struct queue *q = &cnx->q[1];
 
-    q->fd = connect_addr(addr, cnx_name);
-    if (q->fd != -1) {
-        log_connection(cnx);
-        set_nonblock(q->fd);
-        flush_defered(q);
-        if (q->defered_data) {
-            FD_SET(q->fd, fds_w);
-        } else {
-            FD_SET(q->fd, fds_r);
+    q->fd = connect_poll(&cnx->connect, 0);
+    if (q->fd == -1) {
+        connect_attempts(cnx);
+        return;
+    }
+
+    timer_cancel(&connecting, cnx);
+    if (cnx->pool)
+        pool_add(cnx);
+    else
+        start_shoveling(cnx);
+}
+
+/* Starts connections to the servers of the pools that are missing some, unless
+ * they lost some too recently */
+static void fill_pools(void)
+{
+    struct backend_pool *pool;
+    struct connection *cnx;
+    long long now = monotonic_ms();
+
+    for (pool = pools; pool; pool = pool->next) {
+        while (pool_missing(pool) && (pool->retry_at <= now)) {
+            cnx = slab_alloc(&cnx_pool);
+            if (!cnx) {
+                pool->retry_at = now + POOL_RETRY_DELAY;
+                break;
+            }
+            init_cnx(cnx);
+            cnx->pool = pool;
+            cnx->state = ST_CONNECTING;
+            pool->num_connecting++;
+            connect_init(&cnx->connect, pool->prot->saddr, pool->prot->description);
+            connect_attempts(cnx);
         }
-        return q->fd;
-    } else {
-        tidy_connection(cnx, fds_r, fds_w);
-        return -1;
     }
 }
 
-/* shovels data from active fd to the other
-   returns after one socket closed or operation would block
+/* Gives the client a connection to the server of prot from its pool, if there
+ * is one in good health (the server may have closed it without us noticing
+ * yet). Returns 1 if the connection is now shoveling, 0 if it still needs to
+ * connect to the server. */
+static int pool_connect(struct connection *cnx, struct proto *prot)
+{
+    struct backend_pool *pool;
+    struct connection *pooled;
+    char c;
+    int res;
+
+    for (pool = pools; pool && (pool->prot != prot); pool = pool->next);
+    if (!pool)
+        return 0;
+
+    while ((pooled = pool->ready.head)) {
+        res = recv(pooled->q[1].fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if ((res == 0) || ((res == -1) && (errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+            if (verbose)
+                fprintf(stderr, "discarding stale pooled connection fd %d\n", pooled->q[1].fd);
+            tidy_connection(pooled);
+            continue;
+        }
+
+        /* Healthy: hand its socket over to the client. Events already
+         * returned for the pooled structure are skipped as its descriptor is
+         * now -1. */
+        pool_remove(pooled);
+        cnx->q[1].fd = pooled->q[1].fd;
+        pooled->q[1].fd = -1;
+        tidy_connection(pooled);
+
+        start_shoveling(cnx);
+        return 1;
+    }
+    return 0;
+}
+
+/* Sets up a pool for each protocol that has a 'pool' setting */
+static void init_pools(void)
+{
+    struct proto *p;
+    struct backend_pool *pool;
+
+    for (p = get_first_protocol(); p; p = p->next) {
+        if (!p->pool_size)
+            continue;
+        pool = calloc(1, sizeof(*pool));
+        if (!pool) {
+            log_message(LOG_ERR, "out of memory -- no pool for %s\n", p->description);
+            continue;
+        }
+        pool->prot = p;
+        pool->next = pools;
+        pools = pool;
+    }
+}
+
+/* Side i of a shoveling connection reached end of file: stop watching it, and
+ * once what it sent has been written to the other side (defered data or
+ * pipe), shut that down for writing and close the connection. Only errors
+ * close it straight away. */
+static void close_when_flushed(struct connection *cnx, int i)
+{
+    struct queue *q = &cnx->q[1-i];
+
+    if (queue_pending(q)) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cnx->q[i].fd, NULL);
+        update_watches(cnx);
+        return;
+    }
+
+    shutdown(q->fd, SHUT_WR);
+    tidy_connection(cnx);
+}
+
+/* Counters on how relaying goes: each time a connection is relayed
+ * (shovel()), it ends because there was no more data to read, because the
+ * other side couldn't take more, or because the relay budget ran out. They
+ * are logged when receiving SIGUSR1. */
+struct relay_stats {
+    unsigned long relays;
+    unsigned long drained;
+    unsigned long stalled;
+    unsigned long budget_hit;
+    unsigned long long bytes;
+};
+
+static __thread struct relay_stats relay_stats;
+
+/* Incremented by SIGUSR1; each worker logs its counters when it notices */
+static volatile sig_atomic_t stats_requests;
+
+static void request_stats(int sig)
+{
+    stats_requests++;
+}
+
+static void log_relay_stats(void)
+{
+    log_message(LOG_INFO, "relay stats: %lu relays, %lu drained, %lu stalled, "
+                "%lu over budget, %llu bytes\n",
+                relay_stats.relays, relay_stats.drained, relay_stats.stalled,
+                relay_stats.budget_hit, relay_stats.bytes);
+}
+
+/* shovels data from active fd to the other, until there is no more data to
+ * read, the other side is full (see update_watches()), or relay_budget bytes
+ * have been moved (then the rest waits until the next turn of the event loop,
+ * so other connections get their turn)
  */
-void shovel(struct connection *cnx, int active_fd, 
-            fd_set *fds_r, fd_set *fds_w)
+void shovel(struct connection *cnx, int active_fd)
 {
     struct queue *read_q, *write_q;
+    int res, moved = 0, was_pending, size;
 
     read_q = &cnx->q[active_fd];
     write_q = &cnx->q[1-active_fd];
@@ -153,184 +566,309 @@ void shovel(struct connection *cnx, int active_fd,
     if (verbose)
         fprintf(stderr, "activity on fd%d\n", read_q->fd);
 
-    switch(fd2fd(write_q, read_q)) {
-    case -1:
-    case FD_CNXCLOSED:
-        tidy_connection(cnx, fds_r, fds_w);
-        break;
+    was_pending = queue_pending(write_q);
+    relay_stats.relays++;
+    do {
+        size = queue_size(write_q);
+        res = fd2fd(write_q, read_q);
+        switch(res) {
+        case -1:
+            tidy_connection(cnx);
+            return;
+
+        case FD_CNXCLOSED:
+            close_when_flushed(cnx, active_fd);
+            return;
+
+        case FD_NODATA:
+            relay_stats.drained++;
+            goto done;
+
+        case FD_STALLED:
+            /* End of file, but data still waits for the other side */
+            if (read_q->eof) {
+                close_when_flushed(cnx, active_fd);
+                return;
+            }
+            /* Data is piling up in the queue: carry on reading until it
+             * reaches the high watermark */
+            if (queue_full(write_q, cnx->high_watermark)) {
+                relay_stats.stalled++;
+                goto done;
+            }
+            res = queue_size(write_q) - size;
+            if (res < 0)
+                res = 0;
+            break;
+        }
+        moved += res;
+        relay_stats.bytes += res;
+    } while (moved < relay_budget);
+
+    relay_stats.budget_hit++;
 
-    case FD_STALLED:
-        FD_SET(write_q->fd, fds_w);
-        FD_CLR(read_q->fd, fds_r);
-        break;
+done:
+    if ((queue_pending(write_q) != was_pending) || 
+        queue_full(write_q, cnx->high_watermark))
+        update_watches(cnx);
+}
+
+/* Writes as much defered data as possible to queue j of the connection. Once
+ * the data goes down to the low watermark, restart reading from the other
+ * side; once it is all written, stop monitoring for write (or close the
+ * connection if the other side reached end of file). */
+void flush_queue(struct connection *cnx, int j)
+{
+    struct queue *q = &cnx->q[j];
+    int res;
 
-    default: /* Nothing */
-        break;
+    res = flush_defered(q);
+    if ((res == -1) && (errno != EAGAIN) && (errno != EINTR)) {
+        tidy_connection(cnx);
+        return;
     }
+
+    if (!queue_pending(q) && cnx->q[1-j].eof) {
+        close_when_flushed(cnx, 1-j);
+        return;
+    }
+
+    if (!queue_pending(q) || (q->full && (queue_size(q) <= cnx->low_watermark)))
+        update_watches(cnx);
 }
 
-/* returns true if specified fd is initialised and present in fd_set */
-int is_fd_active(int fd, fd_set* set)
+/* Probes the protocol of a connection (with what it sent so far if timed_out
+ * is set), then connects it to the corresponding server. If the probes need
+ * more data, the connection stays in ST_PROBING until more comes. */
+void connect_probed(struct connection *cnx, int timed_out)
 {
-    if (fd == -1) return 0;
-    return FD_ISSET(fd, set);
+    struct proto *prot;
+
+    /* If timed out it's whatever the client sent so far tells (SSH if
+     * nothing), otherwise the client sent data so probe the protocol */
+    if (timed_out) {
+        prot = probe_timed_out(cnx);
+    } else {
+        prot = probe_client_protocol(cnx);
+        if (!prot)
+            return;
+    }
+
+    timer_cancel(&probing, cnx);
+    cnx->state = ST_CONNECTING;
+
+    cnx->low_watermark = prot->low_watermark ? prot->low_watermark : low_watermark;
+    cnx->high_watermark = prot->high_watermark ? prot->high_watermark : high_watermark;
+
+    /* libwrap check if required for this protocol */
+    if (prot->service && 
+        check_access_rights(cnx->q[0].fd, prot->service)) {
+        /* check_access_rights() closed the socket already */
+        cnx->q[0].fd = -1;
+        tidy_connection(cnx);
+    } else if (!pool_connect(cnx, prot)) {
+        connect_queue(cnx, prot->saddr, prot->description);
+    }
 }
 
-/* Main loop: the idea is as follow:
- * - fds_r and fds_w contain the file descritors to monitor in read and write
+/* Event loop of one worker: the idea is as follow:
+ * - All file descriptors are registered in an epoll set. The user data of
+ * each event points to the connection (and tells which of its two queues is
+ * concerned), so each wake-up only processes the connections that are
+ * ready, however many there are.
  * - When a file descriptor goes off, process it: read from it, write the data
  * to its corresponding pair.
- * - When a file descriptor blocks when writing, remove the read fd from fds_r,
- * move the data to a defered buffer, and add the write fd to fds_w. Defered
- * buffer is allocated dynamically.
+ * - When a file descriptor blocks when writing, move the data to a defered
+ * buffer, and monitor the write fd for writing. Defered buffers come from a
+ * pool (or, with --splice, data stays in the pipe it was spliced to). Keep
+ * reading from the read fd, adding to the defered data, until it reaches the
+ * high watermark: then stop monitoring the read fd.
  * - When we can write to a file descriptor that has defered data, we try to
- * write as much as we can. Once all data is written, remove the fd from fds_w
- * and add its corresponding pair to fds_r, free the buffer.
+ * write as much as we can. Once the defered data goes down to the low
+ * watermark, restart monitoring its corresponding pair for reading. Once all
+ * data is written, stop monitoring the fd for writing and give the buffer
+ * back to the pool.
+ *
+ * That way, the connection to a slow or distant peer always has data ready
+ * to send, while the amount of memory each connection uses stays bounded.
+ *
+ * Connections that are still probing are kept in a list ordered by deadline,
+ * so timeouts cost nothing until they expire.
+ *
+ * Connections to the servers are non-blocking, so a slow server never holds
+ * up the other connections: we wait for the socket to become writable, then
+ * check whether the connection succeeded. If the server has several
+ * addresses, a new attempt starts every CONNECT_ATTEMPT_DELAY until one
+ * succeeds (see connect_next()).
  *
- * That way, each pair of file descriptor (read from one, write to the other)
- * is monitored either for read or for write, but never for both.
+ * Events are level-triggered. New connections are only accepted once all the
+ * other events returned by epoll_wait() have been processed, so an event can
+ * never be applied to a connection structure that got re-used in the
+ * meantime.
  */
-void main_loop(int listen_sockets[], int num_addr_listen, int *map_socket)
+static void event_loop(int listen_sockets[], int num_addr_listen)
 {
-    fd_set fds_r, fds_w;  /* reference fd sets (used to init the next 2) */
-    fd_set readfds, writefds; /* working read and write fd sets */
-    struct timeval tv;
-    int max_fd, in_socket, i, j, res;
-    struct connection *cnx;
-    struct proto *prot;
-    int num_cnx;  /* Number of connections in *cnx */
-    int num_probing = 0; /* Number of connections currently probing 
-                          * We use this to know if we need to time out of
-                          * select() */
+    struct epoll_event events[MAX_EVENTS], ev;
+    int i, j, n, res, listen_ready, listener;
+    struct connection *c;
+    long long now;
+    sig_atomic_t stats_seen = 0;
 
-    FD_ZERO(&fds_r);
-    FD_ZERO(&fds_w);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    CHECK_RES_DIE(epoll_fd, "epoll_create");
 
     for (i = 0; i < num_addr_listen; i++) {
-        FD_SET(listen_sockets[i], &fds_r); 
         set_nonblock(listen_sockets[i]);
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = EV_LISTEN_DATA(i);
+        res = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sockets[i], &ev);
+        CHECK_RES_DIE(res, "epoll_ctl");
     }
-    max_fd = listen_sockets[num_addr_listen-1] + 1;
 
-    cnx_num_alloc = getpagesize() / sizeof(struct connection);
-
-    num_cnx = cnx_num_alloc; /* Start with a set pool of slots */
-    cnx = malloc(num_cnx * sizeof(struct connection));
-    for (i = 0; i < num_cnx; i++)
-        init_cnx(&cnx[i]);
+    slab_pool_init(&cnx_pool, sizeof(struct connection));
+    init_pools();
 
     while (1)
     {
-        memset(&tv, 0, sizeof(tv));
-        tv.tv_sec = probing_timeout;
+        if (verbose)
+            fprintf(stderr, "waiting... %s\n", probing.head ? "probing" : "");
+        n = epoll_wait(epoll_fd, events, MAX_EVENTS, timer_wait());
+        if (n < 0) {
+            if (errno != EINTR)
+                perror("epoll_wait");
+            n = 0;
+        }
 
-        memcpy(&readfds, &fds_r, sizeof(readfds));
-        memcpy(&writefds, &fds_w, sizeof(writefds));
+        if (stats_seen != stats_requests) {
+            stats_seen = stats_requests;
+            log_relay_stats();
+            log_probe_stats();
+        }
 
-        if (verbose)
-            fprintf(stderr, "selecting... max_fd=%d num_probing=%d\n", max_fd, num_probing);
-        res = select(max_fd, &readfds, &writefds, NULL, num_probing ? &tv : NULL);
-        if (res < 0)
-            perror("select");
-
-
-        /* Check main socket for new connections */
-        for (i = 0; i < num_addr_listen; i++) {
-            if (FD_ISSET(listen_sockets[i], &readfds)) {
-                in_socket = accept_new_connection(listen_sockets[i], &cnx, &num_cnx);
-                if (in_socket != -1)
-                    num_probing++;
-
-                if (in_socket > 0) {
-                    FD_SET(in_socket, &fds_r);
-                    if (in_socket >= max_fd)
-                        max_fd = in_socket + 1;;
-                }
-                FD_CLR(listen_sockets[i], &readfds);
+        listen_ready = 0;
+        for (i = 0; i < n; i++) {
+            if (events[i].data.u64 & EV_LISTEN) {
+                listen_ready = 1;
+                continue;
             }
-        }
 
-        /* Check all sockets for write activity */
-        for (i = 0; i < num_cnx; i++) {
-            if (cnx[i].q[0].fd != -1) {
-                for (j = 0; j < 2; j++) {
-                    if (is_fd_active(cnx[i].q[j].fd, &writefds)) {
-                        res = flush_defered(&cnx[i].q[j]);
-                        if ((res == -1) && ((errno == EPIPE) || (errno == ECONNRESET))) {
-                            if (cnx[i].state == ST_PROBING) num_probing--;
-                            tidy_connection(&cnx[i], &fds_r, &fds_w);
-                            if (verbose)
-                                fprintf(stderr, "closed slot %d\n", i);
-                        }
-                        /* If no defered data is left, stop monitoring the fd 
-                         * for write, and restart monitoring the other one for reads*/
-                        if (!cnx[i].q[j].defered_data_size) {
-                            FD_CLR(cnx[i].q[j].fd, &fds_w);
-                            FD_SET(cnx[i].q[1-j].fd, &fds_r);
-                        }
-                    }
-                }
+            c = EV_PTR(events[i].data.u64);
+            j = events[i].data.u64 & EV_QUEUE_MASK;
+
+            /* Attempt to connect to the server finished (unless another one
+             * already won, or the connection was closed) */
+            if (events[i].data.u64 & EV_CONNECT) {
+                if (c->state == ST_CONNECTING)
+                    connect_done(c);
+                continue;
             }
-        }
 
-        /* Check all sockets for read activity */
-        for (i = 0; i < num_cnx; i++) {
-            for (j = 0; j < 2; j++) {
-                if (is_fd_active(cnx[i].q[j].fd, &readfds) || 
-                    ((cnx[i].state == ST_PROBING) && (cnx[i].probe_timeout < time(NULL)))) {
-                    if (verbose)
-                        fprintf(stderr, "processing fd%d slot %d\n", j, i);
-
-                    switch (cnx[i].state) {
-
-                    case ST_PROBING:
-                        if (j == 1) {
-                            fprintf(stderr, "Activity on fd2 while probing, impossible\n");
-                            dump_connection(&cnx[i]);
-                            exit(1);
-                        }
-                        num_probing--;
-                        cnx[i].state = ST_SHOVELING;
-
-                        /* If timed out it's SSH, otherwise the client sent
-                         * data so probe the protocol */
-                        if ((cnx[i].probe_timeout < time(NULL))) {
-                            prot = timeout_protocol();
-                        } else {
-                            prot = probe_client_protocol(&cnx[i]);
-                        }
-
-                        /* libwrap check if required for this protocol */
-                        if (prot->service && 
-                            check_access_rights(in_socket, prot->service)) {
-                            tidy_connection(&cnx[i], &fds_r, &fds_w);
-                            res = -1;
-                        } else {
-                            res = connect_queue(&cnx[i], 
-                                                prot->saddr, 
-                                                prot->description, 
-                                                &fds_r, &fds_w);
-                        }
-
-                        if (res >= max_fd)
-                            max_fd = res + 1;;
-                        break;
+            /* Connection closed by a previous event of this round */
+            if (c->q[j].fd == -1)
+                continue;
 
-                    case ST_SHOVELING:
-                        shovel(&cnx[i], j, &fds_r, &fds_w);
+            if (verbose)
+                fprintf(stderr, "processing fd%d (%d) events %x\n", 
+                        j, c->q[j].fd, events[i].events);
+
+            switch (c->state) {
+            case ST_PROBING:
+                if (j == 1) {
+                    fprintf(stderr, "Activity on fd2 while probing, impossible\n");
+                    dump_connection(c);
+                    exit(1);
+                }
+                connect_probed(c, 0);
+                break;
+
+            case ST_CONNECTING:
+                /* Client went away before we got to the server */
+                tidy_connection(c);
+                break;
+
+            case ST_POOLED:
+                /* Server closed a connection waiting in the pool */
+                if (verbose)
+                    fprintf(stderr, "pooled connection fd %d closed\n", c->q[1].fd);
+                tidy_connection(c);
+                break;
+
+            case ST_SHOVELING:
+                /* Event returned for a side that reached end of file before
+                 * it stopped being watched */
+                if (c->q[j].eof)
+                    break;
+
+                /* Error or hang-up on a file descriptor that is not being
+                 * read: the other side will never get more data */
+                if ((events[i].events & (EPOLLERR | EPOLLHUP)) && 
+                    !(events[i].events & (EPOLLIN | EPOLLOUT))) {
+                    tidy_connection(c);
+                    break;
+                }
+                if ((events[i].events & EPOLLOUT) && queue_pending(&c->q[j])) {
+                    flush_queue(c, j);
+                    if (c->q[j].fd == -1)
                         break;
-
-                    default: /* illegal */
-                        log_message(LOG_ERR, "Illegal connection state %d\n", cnx[i].state);
-                        exit(1);
-                    }
                 }
+                if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && 
+                    !c->q[1-j].full && !c->q[1-j].eof)
+                    shovel(c, j);
+                break;
+
+            default: /* illegal */
+                log_message(LOG_ERR, "Illegal connection state %d\n", c->state);
+                exit(1);
+            }
+        }
+
+        /* Connect probing connections that timed out */
+        now = monotonic_ms();
+        while (probing.head && (probing.head->deadline <= now)) {
+            if (verbose)
+                fprintf(stderr, "timeout on fd %d\n", probing.head->q[0].fd);
+            connect_probed(probing.head, 1);
+        }
+
+        /* Start connection attempts that are due */
+        while (connecting.head && (connecting.head->deadline <= now))
+            connect_attempts(connecting.head);
+
+        /* Check main sockets for new connections */
+        if (listen_ready) {
+            for (i = 0; i < n; i++) {
+                if (!(events[i].data.u64 & EV_LISTEN))
+                    continue;
+                listener = EV_LISTEN_INDEX(events[i].data.u64);
+                accept_new_connections(listen_sockets[listener], listener);
             }
         }
+
+        fill_pools();
+
+        /* Give memory left over by closed connections back to the system;
+         * no event refers to them anymore */
+        slab_trim(&cnx_pool);
+        trim_buffers();
     }
 }
 
 
+/* Main loop: listen_sockets holds num_threads sets of sockets; each worker
+ * thread runs its own event loop on one of them. */
+void main_loop(int listen_sockets[], int num_addr_listen, int *map_socket)
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stats;
+    sigaction(SIGUSR1, &action, NULL);
+
+    run_workers(listen_sockets, num_addr_listen, event_loop);
+}
+
+
 void start_shoveler(int listen_socket) {
     fprintf(stderr, "inetd mode is not supported in select mode\n");
     exit(1);
@@ -0,0 +1,766 @@
+/*
+   sslh-uring: mono-processus server based on io_uring
+
+# Copyright (C) 2007-2012  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+
+*/
+
+#include "common.h"
+#include "probe.h"
+#include "slab.h"
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+const char* server_type = "sslh-uring";
+
+/* sslh-uring does the same job as sslh-select, but all accepts, connects,
+ * reads and writes are submitted asynchronously to the kernel through an
+ * io_uring (see io_uring(7)), so each turn of the loop costs a single
+ * io_uring_enter() whatever the number of operations completed:
+ * - each listening socket has a multishot accept pending;
+ * - a new connection gets a read linked to a timeout of probing_timeout
+ *   seconds; whichever finishes first decides how to route the connection;
+ * - connections to the server are established asynchronously, trying each
+ *   address of the protocol in turn;
+ * - each direction of a connection owns one buffer: read into it, write it
+ *   all out to the other side, read again. That gives flow control for free.
+ *   Buffers are registered with the kernel when possible, so reads and
+ *   writes don't need to map user memory each time.
+ *
+ * We talk to the kernel directly rather than through liburing, as we only
+ * need a handful of operations. */
+
+/* Number of entries in the submission ring; the completion ring is twice
+ * that */
+#define RING_ENTRIES    4096
+
+/* Size of each relay buffer */
+#define RELAY_BUFSIZE   16384
+
+/* Buffers are allocated (and registered) by chunks of BUF_CHUNK; at most
+ * MAX_CHUNKS chunks are registered, buffers allocated after that are used
+ * with normal (unregistered) reads and writes */
+#define BUF_CHUNK       64
+#define MAX_CHUNKS      1024
+
+/* What a completion is for, stored in the low bits of the user data (the rest
+ * is the pointer to the connection, or the index of the listening socket for
+ * OP_ACCEPT and OP_ACCEPT_RETRY) */
+enum uring_op {
+    OP_READ0 = 0,       /* read from q[0] (+ queue index) */
+    OP_READ1,
+    OP_WRITE0,          /* write to q[0] (+ queue index) */
+    OP_WRITE1,
+    OP_CONNECT,
+    OP_TIMEOUT,
+    OP_ACCEPT,
+    OP_ACCEPT_RETRY,    /* accept failed: wait before trying again */
+};
+#define OP_BITS         3
+#define OP_MASK         ((1 << OP_BITS) - 1)
+
+#define UD(ptr, op)     ((uint64_t)(uintptr_t)(ptr) | (op))
+#define UD_PTR(ud)      ((void*)(uintptr_t)((ud) & ~(uint64_t)OP_MASK))
+#define UD_OP(ud)       ((ud) & OP_MASK)
+
+struct relay_buf {
+    char *data;
+    int index;                  /* registered buffer index, or -1 */
+    struct relay_buf *next;     /* next free buffer */
+};
+
+struct uring_cnx {
+    struct connection cnx;
+
+    /* buf[i] holds data read from q[i], to be written to q[1-i] */
+    struct relay_buf *buf[2];
+    int len[2], off[2];
+
+    struct addrinfo *saddr;     /* next server address to try */
+    const char *prot_name;
+    struct __kernel_timespec probe_ts;
+    long long probe_deadline;   /* see monotonic_ms() */
+    int inflight;               /* number of operations not yet completed */
+    int closing;
+};
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned sq_local_tail, to_submit;
+};
+
+static __thread struct uring ring;
+static __thread struct slab_pool cnx_pool;
+static __thread struct relay_buf *free_bufs;
+static __thread int num_chunks, registered_bufs;
+static __thread int multishot_accept = 1;
+static __thread int *listen_fds;
+
+/* Completions taken off the completion ring before event_loop() got to them
+ * (see get_sqe()), oldest first */
+static __thread struct io_uring_cqe *stashed;
+static __thread int num_stashed, stash_size;
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void ring_init(void)
+{
+    struct io_uring_params p;
+    struct io_uring_rsrc_register reg;
+    size_t sq_size, cq_size;
+    char *sq_ptr, *cq_ptr;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = RING_ENTRIES * 2;
+    ring.fd = uring_setup(RING_ENTRIES, &p);
+    CHECK_RES_DIE(ring.fd, "io_uring_setup");
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && (cq_size > sq_size))
+        sq_size = cq_size;
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+    }
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    ring.sq_head = (unsigned*)(sq_ptr + p.sq_off.head);
+    ring.sq_tail = (unsigned*)(sq_ptr + p.sq_off.tail);
+    ring.sq_mask = (unsigned*)(sq_ptr + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)(sq_ptr + p.sq_off.array);
+    ring.sq_entries = p.sq_entries;
+    ring.cq_head = (unsigned*)(cq_ptr + p.cq_off.head);
+    ring.cq_tail = (unsigned*)(cq_ptr + p.cq_off.tail);
+    ring.cq_mask = (unsigned*)(cq_ptr + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(cq_ptr + p.cq_off.cqes);
+    ring.sq_local_tail = *ring.sq_tail;
+
+    /* Reserve a sparse table of registered buffers, filled as chunks get
+     * allocated. If the kernel won't let us, just use plain buffers. */
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = MAX_CHUNKS;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    registered_bufs =
+        uring_register(ring.fd, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) == 0;
+    if (verbose)
+        fprintf(stderr, "io_uring ready, %s registered buffers\n",
+                registered_bufs ? "with" : "without");
+}
+
+/* Sends all queued submissions to the kernel and waits for at least
+ * min_complete completions. Returns -1 if the kernel can't take them now
+ * (EAGAIN, or EBUSY: the completion ring overflowed): completions have to be
+ * consumed before trying again, retrying straight away could spin forever. */
+static int ring_submit(unsigned min_complete)
+{
+    int res;
+
+    res = uring_enter(ring.fd, ring.to_submit, min_complete,
+                      min_complete ? IORING_ENTER_GETEVENTS : 0);
+    if (res >= 0) {
+        ring.to_submit -= res;
+        return 0;
+    }
+    if ((errno == EAGAIN) || (errno == EBUSY))
+        return -1;
+    if (errno != EINTR) {
+        perror("io_uring_enter");
+        exit(1);
+    }
+    return 0;
+}
+
+/* Moves the completions waiting in the completion ring to stashed[], which
+ * makes room in the ring */
+static void stash_completions(void)
+{
+    unsigned head = *ring.cq_head;
+
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        if (num_stashed == stash_size) {
+            stash_size = stash_size ? stash_size * 2 : RING_ENTRIES;
+            stashed = realloc(stashed, stash_size * sizeof(*stashed));
+            if (!stashed) {
+                log_message(LOG_ERR, "out of memory for completions\n");
+                exit(1);
+            }
+        }
+        stashed[num_stashed++] = ring.cqes[head & *ring.cq_mask];
+        head++;
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/* Returns a blank submission entry, having made sure at least `needed`
+ * entries are available (so linked entries end up in the same submission).
+ * If the submission ring is full and the kernel won't take its entries until
+ * completions are consumed, they are stashed for event_loop(). */
+static struct io_uring_sqe* get_sqe(unsigned needed)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    while (ring.sq_local_tail + needed -
+           __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) > ring.sq_entries)
+        if (ring_submit(0) == -1)
+            stash_completions();
+
+    idx = ring.sq_local_tail & *ring.sq_mask;
+    sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[idx] = idx;
+    ring.sq_local_tail++;
+    ring.to_submit++;
+    __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+
+/* Relay buffers */
+
+static void alloc_buf_chunk(void)
+{
+    struct io_uring_rsrc_update2 up;
+    struct relay_buf *bufs;
+    struct iovec iov;
+    char *mem;
+    int i, index = -1;
+
+    mem = malloc(BUF_CHUNK * RELAY_BUFSIZE);
+    bufs = malloc(BUF_CHUNK * sizeof(*bufs));
+    if (!mem || !bufs) {
+        free(mem);
+        free(bufs);
+        return;
+    }
+
+    if (registered_bufs && (num_chunks < MAX_CHUNKS)) {
+        iov.iov_base = mem;
+        iov.iov_len = BUF_CHUNK * RELAY_BUFSIZE;
+        memset(&up, 0, sizeof(up));
+        up.offset = num_chunks;
+        up.data = (uint64_t)(uintptr_t)&iov;
+        up.nr = 1;
+        if (uring_register(ring.fd, IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up)) == 1) {
+            index = num_chunks;
+        } else {
+            if (verbose)
+                fprintf(stderr, "registering buffers: %s\n", strerror(errno));
+            registered_bufs = 0;
+        }
+    }
+    num_chunks++;
+
+    for (i = 0; i < BUF_CHUNK; i++) {
+        bufs[i].data = mem + i * RELAY_BUFSIZE;
+        bufs[i].index = index;
+        bufs[i].next = free_bufs;
+        free_bufs = &bufs[i];
+    }
+}
+
+static struct relay_buf* get_buf(void)
+{
+    struct relay_buf *b;
+
+    if (!free_bufs)
+        alloc_buf_chunk();
+    b = free_bufs;
+    if (b)
+        free_bufs = b->next;
+    return b;
+}
+
+static void release_buf(struct relay_buf *b)
+{
+    if (!b) return;
+    b->next = free_bufs;
+    free_bufs = b;
+}
+
+
+/* Submissions */
+
+static void submit_accept(int i)
+{
+    struct io_uring_sqe *sqe = get_sqe(1);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fds[i];
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (multishot_accept)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = UD((uintptr_t)i << OP_BITS, OP_ACCEPT);
+}
+
+/* How long to wait before accepting again on a listening socket after an
+ * error such as running out of file descriptors, so the loop doesn't spin */
+static const struct __kernel_timespec accept_retry_ts = { 0, 100000000 };
+
+static void submit_accept_retry(int i)
+{
+    struct io_uring_sqe *sqe = get_sqe(1);
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&accept_retry_ts;
+    sqe->len = 1;
+    sqe->user_data = UD((uintptr_t)i << OP_BITS, OP_ACCEPT_RETRY);
+}
+
+/* Reads from q[i] into the free space of buf[i] */
+static struct io_uring_sqe* submit_read(struct uring_cnx *u, int i, unsigned needed)
+{
+    struct io_uring_sqe *sqe = get_sqe(needed);
+    struct relay_buf *b = u->buf[i];
+
+    sqe->opcode = (b->index >= 0) ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = u->cnx.q[i].fd;
+    sqe->addr = (uint64_t)(uintptr_t)b->data;
+    sqe->len = RELAY_BUFSIZE;
+    if (b->index >= 0)
+        sqe->buf_index = b->index;
+    sqe->user_data = UD(u, OP_READ0 + i);
+    u->inflight++;
+    return sqe;
+}
+
+/* Writes what's left of buf[i] to q[1-i] */
+static void submit_write(struct uring_cnx *u, int i)
+{
+    struct io_uring_sqe *sqe = get_sqe(1);
+    struct relay_buf *b = u->buf[i];
+
+    sqe->opcode = (b->index >= 0) ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = u->cnx.q[1-i].fd;
+    sqe->addr = (uint64_t)(uintptr_t)(b->data + u->off[i]);
+    sqe->len = u->len[i] - u->off[i];
+    if (b->index >= 0)
+        sqe->buf_index = b->index;
+    sqe->user_data = UD(u, OP_WRITE0 + 1 - i);
+    u->inflight++;
+}
+
+/* Read from the client while probing, after what it sent so far, linked to
+ * what is left of the probing timeout */
+static void submit_probe(struct uring_cnx *u)
+{
+    struct io_uring_sqe *sqe;
+    long long wait;
+
+    sqe = submit_read(u, 0, 2);
+    sqe->addr += u->len[0];
+    sqe->len = MAX_PROBE_SIZE - u->len[0];
+    sqe->flags |= IOSQE_IO_LINK;
+
+    wait = u->probe_deadline - monotonic_ms();
+    if (wait < 0)
+        wait = 0;
+    u->probe_ts.tv_sec = wait / 1000;
+    u->probe_ts.tv_nsec = (wait % 1000) * 1000000;
+    sqe = get_sqe(1);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&u->probe_ts;
+    sqe->len = 1;
+    sqe->user_data = UD(u, OP_TIMEOUT);
+    u->inflight++;
+}
+
+/* Starts an asynchronous connection to the next address of the protocol.
+ * Returns -1 if no address is left. */
+static int submit_connect(struct uring_cnx *u)
+{
+    struct io_uring_sqe *sqe;
+    struct addrinfo *a;
+    char buf[NI_MAXHOST];
+    int fd;
+
+    for (a = u->saddr; a; a = a->ai_next) {
+        if (verbose)
+            fprintf(stderr, "connecting to %s family %d len %d\n",
+                    sprintaddr(buf, sizeof(buf), a),
+                    a->ai_addr->sa_family, a->ai_addrlen);
+        fd = socket(a->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            log_message(LOG_ERR, "forward to %s failed:socket: %s\n",
+                        u->prot_name, strerror(errno));
+            continue;
+        }
+        u->cnx.q[1].fd = fd;
+        u->saddr = a->ai_next;
+
+        sqe = get_sqe(1);
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)a->ai_addr;
+        sqe->off = a->ai_addrlen;
+        sqe->user_data = UD(u, OP_CONNECT);
+        u->inflight++;
+        return 0;
+    }
+    return -1;
+}
+
+
+/* Connections */
+
+/* Stops all activity on the connection; it is released once all pending
+ * operations have completed */
+static void close_cnx(struct uring_cnx *u)
+{
+    int i;
+
+    if (!u->closing) {
+        u->closing = 1;
+        for (i = 0; i < 2; i++)
+            if (u->cnx.q[i].fd != -1)
+                shutdown(u->cnx.q[i].fd, SHUT_RDWR);
+    }
+
+    if (u->inflight)
+        return;
+
+    for (i = 0; i < 2; i++) {
+        if (u->cnx.q[i].fd != -1) {
+            if (verbose)
+                fprintf(stderr, "closing fd %d\n", u->cnx.q[i].fd);
+            close(u->cnx.q[i].fd);
+        }
+        release_buf(u->buf[i]);
+    }
+    slab_free(&cnx_pool, u);
+}
+
+static void probe_done(struct uring_cnx *u, int res);
+
+static void new_connection(int fd, int listener)
+{
+    struct uring_cnx *u;
+
+    u = slab_alloc(&cnx_pool);
+    if (u) {
+        memset(u, 0, sizeof(*u));
+        u->buf[0] = get_buf();
+        u->buf[1] = get_buf();
+    }
+    if (!u || !u->buf[0] || !u->buf[1]) {
+        log_message(LOG_ERR, "out of memory -- dropping connection\n");
+        if (u) {
+            release_buf(u->buf[0]);
+            release_buf(u->buf[1]);
+            slab_free(&cnx_pool, u);
+        }
+        close(fd);
+        return;
+    }
+
+    init_cnx(&u->cnx);
+    u->cnx.q[0].fd = fd;
+    u->cnx.listener = listener;
+    u->cnx.state = ST_PROBING;
+
+    if (verbose)
+        fprintf(stderr, "accepted fd %d\n", fd);
+
+    /* The kernel already waited for the timeout (--defer-accept) */
+    u->probe_deadline = monotonic_ms() + (long long)(probing_timeout * 1000);
+    if (silent_client(fd))
+        probe_done(u, -ECANCELED);
+    else
+        submit_probe(u);
+}
+
+/* A probing read completed (or got cancelled by the timeout): find out where
+ * to connect to, or wait for more data if the probes can't tell yet */
+static void probe_done(struct uring_cnx *u, int res)
+{
+    struct proto *prot;
+    char *data = u->buf[0]->data;
+
+    if (res > 0) {
+        u->len[0] += res;
+        data[u->len[0]] = 0;
+        prot = probe_buffer(data, u->len[0], monotonic_ms() >= u->probe_deadline,
+                            u->cnx.listener);
+        if (!prot) {
+            submit_probe(u);
+            return;
+        }
+    } else if (u->len[0]) {
+        /* Timed out, or the client closed: what it sent is all there is */
+        prot = probe_buffer(data, u->len[0], 1, u->cnx.listener);
+    } else if (res == -ECANCELED) {
+        /* Timed out: it's SSH (or whatever timeout protocol) */
+        prot = timeout_protocol();
+    } else {
+        close_cnx(u);
+        return;
+    }
+
+    /* libwrap check if required for this protocol */
+    if (prot->service &&
+        check_access_rights(u->cnx.q[0].fd, prot->service)) {
+        /* check_access_rights() closed the socket already */
+        u->cnx.q[0].fd = -1;
+        close_cnx(u);
+        return;
+    }
+
+    u->saddr = prot->saddr;
+    u->prot_name = prot->description;
+    if (submit_connect(u) == -1)
+        close_cnx(u);
+}
+
+static void connect_done(struct uring_cnx *u, int res)
+{
+    if (res < 0) {
+        log_message(LOG_ERR, "forward to %s failed:connect: %s\n",
+                    u->prot_name, strerror(-res));
+        close(u->cnx.q[1].fd);
+        u->cnx.q[1].fd = -1;
+        if (submit_connect(u) == -1)
+            close_cnx(u);
+        return;
+    }
+
+    u->cnx.state = ST_SHOVELING;
+    log_connection(&u->cnx);
+
+    /* Send the probed data, if any, then relay both ways */
+    if (u->len[0])
+        submit_write(u, 0);
+    else
+        submit_read(u, 0, 1);
+    submit_read(u, 1, 1);
+}
+
+static void read_done(struct uring_cnx *u, int i, int res)
+{
+    if (res <= 0) {
+        if (verbose)
+            fprintf(stderr, "%s socket closed\n", i ? "server" : "client");
+        close_cnx(u);
+        return;
+    }
+
+    u->len[i] = res;
+    u->off[i] = 0;
+    submit_write(u, i);
+}
+
+/* Write to q[j] of the data read from q[1-j] completed */
+static void write_done(struct uring_cnx *u, int j, int res)
+{
+    int i = 1 - j;
+
+    if (res < 0) {
+        close_cnx(u);
+        return;
+    }
+
+    u->off[i] += res;
+    if (u->off[i] < u->len[i]) {
+        submit_write(u, i);
+    } else {
+        u->len[i] = u->off[i] = 0;
+        submit_read(u, i, 1);
+    }
+}
+
+static void handle_cqe(struct io_uring_cqe *cqe)
+{
+    struct uring_cnx *u;
+    int op = UD_OP(cqe->user_data);
+
+    if (op == OP_ACCEPT_RETRY) {
+        submit_accept(cqe->user_data >> OP_BITS);
+        return;
+    }
+
+    if (op == OP_ACCEPT) {
+        int i = cqe->user_data >> OP_BITS;
+
+        if (cqe->res >= 0) {
+            new_connection(cqe->res, i);
+        } else if ((cqe->res == -EINVAL) && multishot_accept) {
+            if (verbose)
+                fprintf(stderr, "multishot accept not supported\n");
+            multishot_accept = 0;
+        } else if ((cqe->res != -ECONNABORTED) && (cqe->res != -EINTR)) {
+            /* e.g. out of file descriptors: try again a bit later */
+            log_message(LOG_ERR, "accept: %s\n", strerror(-cqe->res));
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                submit_accept_retry(i);
+            return;
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            submit_accept(i);
+        return;
+    }
+
+    u = UD_PTR(cqe->user_data);
+    u->inflight--;
+
+    if (u->closing) {
+        close_cnx(u);
+        return;
+    }
+
+    switch (op) {
+    case OP_READ0:
+    case OP_READ1:
+        if (u->cnx.state == ST_PROBING)
+            probe_done(u, cqe->res);
+        else
+            read_done(u, op - OP_READ0, cqe->res);
+        break;
+
+    case OP_WRITE0:
+    case OP_WRITE1:
+        write_done(u, op - OP_WRITE0, cqe->res);
+        break;
+
+    case OP_CONNECT:
+        connect_done(u, cqe->res);
+        break;
+
+    case OP_TIMEOUT:
+        /* Nothing to do: the linked read tells what happened */
+        break;
+
+    default: /* illegal */
+        log_message(LOG_ERR, "Illegal operation %d\n", op);
+        exit(1);
+    }
+}
+
+/* Incremented by SIGUSR1; each worker logs its counters when it notices */
+static volatile sig_atomic_t stats_requests;
+
+static void request_stats(int sig)
+{
+    stats_requests++;
+}
+
+static void event_loop(int listen_sockets[], int num_addr_listen)
+{
+    struct io_uring_cqe cqe;
+    unsigned head;
+    int i;
+    sig_atomic_t stats_seen = 0;
+
+    ring_init();
+    slab_pool_init(&cnx_pool, sizeof(struct uring_cnx));
+
+    listen_fds = listen_sockets;
+    for (i = 0; i < num_addr_listen; i++)
+        submit_accept(i);
+
+    while (1) {
+        /* Don't wait if there are stashed completions to process. If the
+         * kernel won't take the submissions, consume the completions: they
+         * are submitted again at the next turn. */
+        ring_submit(num_stashed ? 0 : 1);
+
+        /* Stashed completions are older than those in the ring. Handling
+         * them may stash more, which get handled in turn. */
+        for (i = 0; i < num_stashed; i++) {
+            cqe = stashed[i];
+            handle_cqe(&cqe);
+        }
+        num_stashed = 0;
+
+        while ((head = *ring.cq_head) != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = ring.cqes[head & *ring.cq_mask];
+            __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+            handle_cqe(&cqe);
+        }
+        slab_trim(&cnx_pool);
+
+        if (stats_seen != stats_requests) {
+            stats_seen = stats_requests;
+            log_probe_stats();
+        }
+    }
+}
+
+void main_loop(int listen_sockets[], int num_addr_listen, int *map_socket)
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stats;
+    sigaction(SIGUSR1, &action, NULL);
+
+    run_workers(listen_sockets, num_addr_listen, event_loop);
+}
+
+
+void start_shoveler(int listen_socket) {
+    fprintf(stderr, "inetd mode is not supported in io_uring mode\n");
+    exit(1);
+}
+
+
+/* The actual main is in common.c: it's the same for both version of
+ * the server
+ */
+
+
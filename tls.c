@@ -0,0 +1,181 @@
+/*
+# tls.c: parsing of TLS ClientHello messages
+#
+# Copyright (C) 2007-2012  Yves Rutschle
+#
+# This program is free software; you can redistribute it
+# and/or modify it under the terms of the GNU General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied
+# warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+# PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# The full text for the General Public License is here:
+# http://www.gnu.org/licenses/gpl.html
+*/
+
+#include "tls.h"
+
+/* See RFC5246 6.2.1 and 7.4.1.2, RFC6066 3 and RFC7301 3.1 */
+#define TLS_HEADER_LEN          5
+#define TLS_HANDSHAKE           0x16
+#define TLS_CLIENT_HELLO        1
+#define TLS_RANDOM_LEN          32
+#define EXT_SERVER_NAME         0
+#define EXT_ALPN                16
+#define SNI_HOST_NAME           0
+
+/* Walks through the data; nothing is read at or after end */
+struct reader {
+    const unsigned char *p;
+    int pos, end;
+};
+
+/* Reads an n-byte big-endian integer into *val. Returns 0 if the data stops
+ * before. */
+static int read_uint(struct reader *r, int n, int *val)
+{
+    if (r->pos + n > r->end)
+        return 0;
+    for (*val = 0; n; n--)
+        *val = (*val << 8) | r->p[r->pos++];
+    return 1;
+}
+
+/* Sets the end of what is read to end, or to the end of the data (len) if
+ * that comes first; returns whether it does */
+static int set_end(struct reader *r, int end, int len)
+{
+    r->end = end < len ? end : len;
+    return end > len;
+}
+
+/* Skips n bytes. Returns 0 if the data stops before. */
+static int skip(struct reader *r, int n)
+{
+    if (r->pos + n > r->end)
+        return 0;
+    r->pos += n;
+    return 1;
+}
+
+/* Skips a vector with a length field of n bytes */
+static int skip_vector(struct reader *r, int n)
+{
+    int len;
+
+    return read_uint(r, n, &len) && skip(r, len);
+}
+
+/* Extension server_name: keep the first host_name of the list */
+static void parse_sni(const unsigned char *ext, int len, struct tls_hello *hello)
+{
+    struct reader r = { ext, 0, len };
+    int list_len, type, name_len;
+
+    if (!read_uint(&r, 2, &list_len) || (list_len != len - 2))
+        return;
+    while (read_uint(&r, 1, &type) && read_uint(&r, 2, &name_len)) {
+        if (r.pos + name_len > r.end)
+            return;
+        if (type == SNI_HOST_NAME) {
+            hello->sni = (const char*)ext + r.pos;
+            hello->sni_len = name_len;
+            return;
+        }
+        r.pos += name_len;
+    }
+}
+
+/* Extension application_layer_protocol_negotiation: keep the list, whose
+ * names are checked one by one by tls_next_alpn() */
+static void parse_alpn(const unsigned char *ext, int len, struct tls_hello *hello)
+{
+    struct reader r = { ext, 0, len };
+    int list_len;
+
+    if (!read_uint(&r, 2, &list_len) || (list_len != len - 2) || !list_len)
+        return;
+    hello->alpn = (const char*)ext + 2;
+    hello->alpn_len = list_len;
+}
+
+int parse_tls_hello(const char *data, int len, struct tls_hello *hello)
+{
+    struct reader r = { (const unsigned char*)data, 0, len };
+    int truncated, type, version, rec_len, hs_len, hs_end, ext_type, ext_len;
+
+    memset(hello, 0, sizeof(*hello));
+
+    /* Record header */
+    if (!read_uint(&r, 1, &type) || !read_uint(&r, 2, &version) ||
+        !read_uint(&r, 2, &rec_len))
+        return TLS_HELLO_TRUNCATED;
+    if ((type != TLS_HANDSHAKE) || ((version >> 8) != 3))
+        return TLS_HELLO_INVALID;
+    truncated = set_end(&r, TLS_HEADER_LEN + rec_len, len);
+
+    /* From here on, running out of data is only an error if the whole record
+     * is there */
+#define CHECK_READ(x) if (!(x)) return truncated ? TLS_HELLO_TRUNCATED : TLS_HELLO_INVALID
+
+    /* Handshake header. If the ClientHello goes on in another record, we only
+     * look at this one (and it'll most likely turn out invalid) */
+    CHECK_READ(read_uint(&r, 1, &type));
+    if (type != TLS_CLIENT_HELLO)
+        return TLS_HELLO_INVALID;
+    CHECK_READ(read_uint(&r, 3, &hs_len));
+    hs_end = TLS_HEADER_LEN + rec_len;
+    if (r.pos + hs_len < hs_end) {
+        hs_end = r.pos + hs_len;
+        truncated = set_end(&r, hs_end, len);
+    }
+
+    CHECK_READ(skip(&r, 2 + TLS_RANDOM_LEN));   /* client_version, random */
+    CHECK_READ(skip_vector(&r, 1));             /* session_id */
+    CHECK_READ(skip_vector(&r, 2));             /* cipher_suites */
+    CHECK_READ(skip_vector(&r, 1));             /* compression_methods */
+
+    /* Extensions are optional */
+    if ((r.pos == r.end) && !truncated)
+        return TLS_HELLO_OK;
+    CHECK_READ(read_uint(&r, 2, &ext_len));
+    if (r.pos + ext_len < hs_end)
+        truncated = set_end(&r, r.pos + ext_len, len);
+
+    while (r.pos < r.end) {
+        CHECK_READ(read_uint(&r, 2, &ext_type) && read_uint(&r, 2, &ext_len));
+        CHECK_READ(r.pos + ext_len <= r.end);
+        switch (ext_type) {
+        case EXT_SERVER_NAME:
+            parse_sni(r.p + r.pos, ext_len, hello);
+            break;
+        case EXT_ALPN:
+            parse_alpn(r.p + r.pos, ext_len, hello);
+            break;
+        }
+        r.pos += ext_len;
+    }
+#undef CHECK_READ
+
+    return truncated ? TLS_HELLO_TRUNCATED : TLS_HELLO_OK;
+}
+
+const char* tls_next_alpn(const struct tls_hello *hello, int *pos, int *name_len)
+{
+    const char *name;
+
+    if (!hello->alpn || (*pos >= hello->alpn_len))
+        return NULL;
+    *name_len = (unsigned char)hello->alpn[*pos];
+    if (*pos + 1 + *name_len > hello->alpn_len)
+        return NULL;
+    name = hello->alpn + *pos + 1;
+    *pos += 1 + *name_len;
+    return name;
+}
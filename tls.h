@@ -0,0 +1,45 @@
+/* API for tls.c */
+
+#ifndef __TLS_H_
+#define __TLS_H_
+
+#include "common.h"
+
+/* Results of parse_tls_hello() */
+enum tls_hello_result {
+    TLS_HELLO_INVALID = 0,  /* not a ClientHello, or malformed */
+    TLS_HELLO_OK,           /* the whole ClientHello has been parsed */
+    TLS_HELLO_TRUNCATED     /* the data stops before the end of the ClientHello */
+};
+
+/* What we want to know from a ClientHello. Pointers point into the parsed
+ * buffer; they are NULL if the extension wasn't found. */
+struct tls_hello {
+    const char *sni;        /* server name (not NUL-terminated) */
+    int sni_len;
+    const char *alpn;       /* ALPN protocol_name_list: length-prefixed names */
+    int alpn_len;
+};
+
+/* Routing criteria of a protocol probed with the builtin TLS probe (kept in
+ * proto->data); each is a NULL-terminated list, or NULL to accept anything */
+struct tls_match {
+    const char **sni_hostnames;     /* shell wildcards, e.g. "*.example.org" */
+    const char **alpn_protocols;    /* e.g. "h2", "xmpp-client" */
+};
+
+/* parse_tls_hello
+ *
+ * Parses the TLS record at the beginning of p[0..len[ and fills hello with
+ * the server name and ALPN extensions of the ClientHello it carries. Reads
+ * nothing outside of p[0..len[ and allocates nothing. If the result is
+ * TLS_HELLO_TRUNCATED, hello holds what was found before the end of the data.
+ */
+int parse_tls_hello(const char *p, int len, struct tls_hello *hello);
+
+/* Returns the next protocol name of an ALPN protocol_name_list, starting at
+ * *pos (set *pos to 0 for the first one), and updates *pos; returns NULL once
+ * the list is exhausted. */
+const char* tls_next_alpn(const struct tls_hello *hello, int *pos, int *name_len);
+
+#endif